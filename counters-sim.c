@@ -0,0 +1,373 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <linux/printk.h>
+#include <linux/mutex.h>
+#include <linux/moduleparam.h>
+
+#include "counters.h"
+
+#define DRIVER_AUTHOR "Igor V. Nikolaev <support@vedga.com>"
+#define DRIVER_DESC   "Synthetic pulse train counters"
+#define DRIVER_VERSION "0.1"
+
+#ifdef pr_fmt
+#undef pr_fmt
+#endif
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+/* Max. simulated counters */
+#define SIM_MAX_INSTANCES       4096
+
+/* Max. pulses, generated by the one expiry of the late timer */
+#define SIM_MAX_CATCHUP         64
+
+/* Jitter distributions */
+#define SIM_JITTER_UNIFORM      0
+#define SIM_JITTER_NORMAL       1
+
+/*
+ * Simulated counter (driver's private data)
+ */
+struct counters_sim_counter {
+    /* Class device */
+    struct counters_device *cdev;
+    /* Pulse train timer */
+    struct hrtimer timer;
+    /* Pulses to the end of the current burst */
+    unsigned int burst_left;
+    /* Generated pulses */
+    atomic64_t generated;
+};
+
+static void counters_sim_shutdown(struct counters_device *cdev);
+static int sim_generated_set(const char *val, const struct kernel_param *kp);
+static int sim_generated_get(char *buffer, const struct kernel_param *kp);
+
+/* Simulated counters count */
+static unsigned int instances = 1;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(instances, "Simulated counters count (up to 4096)");
+
+/* Pulse rate (Hz) */
+static unsigned int rate = 100;
+module_param(rate, uint, 0444);
+MODULE_PARM_DESC(rate, "Pulse rate (Hz)");
+
+/* Max. pulse period deviation (us) */
+static unsigned int jitter_us = 0;
+module_param(jitter_us, uint, 0444);
+MODULE_PARM_DESC(jitter_us, "Max. pulse period deviation (us)");
+
+/* Pulse period deviation distribution */
+static char *jitter_dist = "uniform";
+module_param(jitter_dist, charp, 0444);
+MODULE_PARM_DESC(jitter_dist, "Pulse period deviation distribution: uniform or normal");
+
+/* Pulses at the burst or 0 for continuous pulse train */
+static unsigned int burst_length = 0;
+module_param(burst_length, uint, 0444);
+MODULE_PARM_DESC(burst_length, "Pulses at the burst (0 - continuous pulse train)");
+
+/* Pause between bursts (us) */
+static unsigned int burst_pause_us = 0;
+module_param(burst_pause_us, uint, 0444);
+MODULE_PARM_DESC(burst_pause_us, "Pause between bursts (us)");
+
+/* Pulse trains duration (ms) or 0 for endless trains */
+static unsigned int duration_ms = 0;
+module_param(duration_ms, uint, 0444);
+MODULE_PARM_DESC(duration_ms, "Pulse trains duration (ms, 0 - endless)");
+
+/* Generated pulses of all counters (read only) */
+static const struct kernel_param_ops sim_generated_ops = {
+    .set = sim_generated_set,
+    .get = sim_generated_get,
+};
+module_param_cb(generated, &sim_generated_ops, NULL, 0444);
+MODULE_PARM_DESC(generated, "Generated pulses of all counters (read only)");
+
+/* Registered counters */
+static struct counters_device **sim_counters;
+/* Registered counters count (under sim_lock) */
+static unsigned int sim_count;
+/* Serialize access to the counters by the "generated" parameter */
+static DEFINE_MUTEX(sim_lock);
+
+/* Pulse trains end (CLOCK_MONOTONIC) if duration_ms is set */
+static ktime_t sim_end;
+
+/* Pulse period (ns) */
+static u64 sim_period_ns;
+/* Max. pulse period deviation (ns) */
+static u32 sim_jitter_ns;
+/* Pulse period deviation distribution (SIM_JITTER_*) */
+static unsigned int sim_jitter_dist;
+
+/**
+ * Random pulse period deviation
+ * 
+ * @return deviation (ns) in [-jitter, jitter]
+ * 
+ * NOTE:
+ * Normal distribution is approximated by the sum of four uniform values.
+ */
+static s64 sim_jitter(void) {
+    if(!sim_jitter_ns) {
+        return 0;
+    }
+    
+    if(sim_jitter_dist == SIM_JITTER_NORMAL) {
+        u32 half = sim_jitter_ns / 2 + 1;
+        
+        return (s64)prandom_u32_max(half) + prandom_u32_max(half) + 
+               prandom_u32_max(half) + prandom_u32_max(half) - sim_jitter_ns;
+    }
+    
+    return (s64)prandom_u32_max(2 * sim_jitter_ns + 1) - sim_jitter_ns;
+}
+
+/**
+ * Pulse train: generate pulse and schedule the next one
+ * 
+ * @param timer
+ * @return 
+ * 
+ * NOTE:
+ * Next expiry is always in the future. Expiries, passed while timer was late,
+ * are generated as pulses now (up to SIM_MAX_CATCHUP), the rest is skipped,
+ * so overloaded system don't re-run the handler forever.
+ */
+static enum hrtimer_restart sim_timer_handler(struct hrtimer *timer) {
+    struct counters_sim_counter *drvdata =
+        container_of(timer, struct counters_sim_counter, timer);
+    s64 interval = (s64)sim_period_ns + sim_jitter();
+    u64 timestamp = counters_timestamp(drvdata->cdev);
+    u64 overruns;
+    unsigned int n;
+    unsigned int i;
+    
+    if(duration_ms && ktime_after(hrtimer_cb_get_time(timer), sim_end)) {
+        /* End of the pulse train */
+        return HRTIMER_NORESTART;
+    }
+    
+    if(burst_length && !--drvdata->burst_left) {
+        /* End of the burst */
+        drvdata->burst_left = burst_length;
+        
+        interval += (s64)burst_pause_us * NSEC_PER_USEC;
+    }
+    
+    overruns = hrtimer_forward_now(timer, ns_to_ktime(max_t(s64, interval, 1)));
+    n = min_t(u64, max_t(u64, overruns, 1), SIM_MAX_CATCHUP);
+    
+    for(i = 0; i < n; i++) {
+        counters_queue_pulse(drvdata->cdev, timestamp, COUNTERS_EDGE_UNKNOWN);
+    }
+    
+    atomic64_add(n, &drvdata->generated);
+    
+    counters_schedule_flush(drvdata->cdev);
+    
+    return HRTIMER_RESTART;
+}
+
+/**
+ * Driver's shutdown routine: stop pulse train
+ * 
+ * @param cdev
+ */
+static void counters_sim_shutdown(struct counters_device *cdev) {
+    struct counters_sim_counter *drvdata = dev_get_drvdata(&cdev->dev);
+    
+    hrtimer_cancel(&drvdata->timer);
+}
+
+/**
+ * Parameter "generated" is read only
+ * 
+ * @param val
+ * @param kp
+ * @return 
+ */
+static int sim_generated_set(const char *val, const struct kernel_param *kp) {
+    return -EPERM;
+}
+
+/**
+ * Generated pulses of all counters
+ * 
+ * @param buffer
+ * @param kp
+ * @return 
+ * 
+ * NOTE:
+ * With duration_ms the throughput test report it with the counted pulses,
+ * when all pulse trains are finished.
+ */
+static int sim_generated_get(char *buffer, const struct kernel_param *kp) {
+    u64 generated = 0;
+    unsigned int i;
+    
+    mutex_lock(&sim_lock);
+    
+    for(i = 0; i < sim_count; i++) {
+        struct counters_sim_counter *drvdata = dev_get_drvdata(&sim_counters[i]->dev);
+        
+        generated += atomic64_read(&drvdata->generated);
+    }
+    
+    mutex_unlock(&sim_lock);
+    
+    return scnprintf(buffer, PAGE_SIZE, "%llu\n", (unsigned long long)generated);
+}
+
+/**
+ * Build simulated counter
+ * 
+ * @param no - counter number
+ * @return allocated device driver, registered by counters_register_devices()
+ */
+static struct counters_device *build_device(unsigned int no) {
+    char name[32];
+    struct counters_device *cdev;
+    struct counters_sim_counter *drvdata;
+    
+    snprintf(name, sizeof(name), "sim%u", no);
+    
+    cdev = counters_allocate_device(name, sizeof(struct counters_sim_counter));
+    
+    if(IS_ERR_OR_NULL(cdev)) {
+        pr_alert("Unable to allocate class data\n");
+        
+        return cdev ? cdev : ERR_PTR(-ENOMEM);
+    }
+    
+    drvdata = dev_get_drvdata(&cdev->dev);
+    
+    drvdata->cdev = cdev;
+    drvdata->burst_left = burst_length;
+    atomic64_set(&drvdata->generated, 0);
+    
+    hrtimer_init(&drvdata->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    drvdata->timer.function = sim_timer_handler;
+    
+    cdev->shutdown = counters_sim_shutdown;
+    
+    return cdev;
+}
+
+static int __init counters_sim_init(void)
+{
+    unsigned int i;
+    int rc;
+    
+    if(!rate || !instances || instances > SIM_MAX_INSTANCES) {
+        pr_alert("Invalid rate or instances\n");
+        
+        return -EINVAL;
+    }
+    
+    if(!strcmp(jitter_dist, "normal")) {
+        sim_jitter_dist = SIM_JITTER_NORMAL;
+    } else if(!strcmp(jitter_dist, "uniform")) {
+        sim_jitter_dist = SIM_JITTER_UNIFORM;
+    } else {
+        pr_alert("Unknown jitter distribution %s\n", jitter_dist);
+        
+        return -EINVAL;
+    }
+    
+    sim_period_ns = div_u64(NSEC_PER_SEC, rate) ? : 1;
+    sim_jitter_ns = min_t(u64, (u64)jitter_us * NSEC_PER_USEC, sim_period_ns);
+    
+    sim_counters = kcalloc(instances, sizeof(struct counters_device *), GFP_KERNEL);
+    
+    if(!sim_counters) {
+        return -ENOMEM;
+    }
+    
+    for(i = 0; i < instances; i++) {
+        struct counters_device *cdev = build_device(i);
+        
+        if(IS_ERR(cdev)) {
+            pr_alert("Unable to build counter #%u, %u counters will be registered\n", i, i);
+            
+            if(!i) {
+                /* No counters at all */
+                kfree(sim_counters);
+                
+                return PTR_ERR(cdev);
+            }
+            
+            break;
+        }
+        
+        sim_counters[i] = cdev;
+    }
+    
+    /* Whole set is registered at once */
+    rc = counters_register_devices(sim_counters, i);
+    
+    if(rc) {
+        kfree(sim_counters);
+        
+        return rc;
+    }
+    
+    sim_end = ktime_add_ms(ktime_get(), duration_ms);
+    
+    for(i = 0; i < instances && sim_counters[i]; i++) {
+        struct counters_sim_counter *drvdata = dev_get_drvdata(&sim_counters[i]->dev);
+        
+        /* Random phase, so instances don't fire at the same time */
+        hrtimer_start(&drvdata->timer, 
+                      ns_to_ktime(1 + prandom_u32_max(min_t(u64, sim_period_ns, U32_MAX))), 
+                      HRTIMER_MODE_REL);
+    }
+    
+    mutex_lock(&sim_lock);
+    sim_count = i;
+    mutex_unlock(&sim_lock);
+    
+    pr_info("%u counters at %u Hz, jitter %u us (%s), burst %u/%u us\n", 
+            i, rate, jitter_us, jitter_dist, burst_length, burst_pause_us);
+    
+    return 0;
+}
+
+static void __exit counters_sim_exit(void)
+{
+    unsigned int i;
+    
+    /* Counters can't be accessed by the "generated" parameter */
+    mutex_lock(&sim_lock);
+    sim_count = 0;
+    mutex_unlock(&sim_lock);
+    
+    for(i = 0; i < instances && sim_counters[i]; i++) {
+        struct counters_sim_counter *drvdata = dev_get_drvdata(&sim_counters[i]->dev);
+        
+        /* Stop pulse train before devices are unregistered */
+        hrtimer_cancel(&drvdata->timer);
+    }
+    
+    counters_unregister_devices(sim_counters, i);
+    
+    kfree(sim_counters);
+}
+
+
+module_init(counters_sim_init)
+module_exit(counters_sim_exit)
+
+MODULE_LICENSE("GPL v2");
+MODULE_AUTHOR(DRIVER_AUTHOR);
+MODULE_DESCRIPTION(DRIVER_DESC);
+MODULE_VERSION(DRIVER_VERSION);
@@ -0,0 +1,510 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
+#include <linux/printk.h>
+
+#include "counters.h"
+
+#define DRIVER_AUTHOR "Igor V. Nikolaev <support@vedga.com>"
+#define DRIVER_DESC   "Pulse counters class self test"
+#define DRIVER_VERSION "0.1"
+
+#ifdef pr_fmt
+#undef pr_fmt
+#endif
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+/* Injected pulses: first timestamp (ns) */
+#define TEST_START_NS   1000000000ULL
+/* Injected pulses: period (ns) */
+#define TEST_PERIOD_NS  1000000ULL
+/* Concurrent test: pulses queued by the writer before flush */
+#define TEST_BATCH      16
+
+/*
+ * Concurrent test thread
+ */
+struct counters_test_thread {
+    /* Tested device */
+    struct counters_device *dev;
+    /* Thread or NULL if not started */
+    struct task_struct *task;
+    /* Writer: all pulses are injected */
+    struct completion done;
+    /* Writer: injected pulses, reader: snapshots */
+    u64 count;
+    /* Reader: snapshot count went back or beyond injected pulses */
+    unsigned int errors;
+};
+
+/* Concurrent test: writer threads */
+static unsigned int writers = 4;
+module_param(writers, uint, 0444);
+MODULE_PARM_DESC(writers, "Concurrent test: pulse injection threads");
+
+/* Concurrent test: reader threads */
+static unsigned int readers = 2;
+module_param(readers, uint, 0444);
+MODULE_PARM_DESC(readers, "Concurrent test: snapshot reader threads");
+
+/* Concurrent test: pulses by each writer */
+static unsigned int pulses = 100000;
+module_param(pulses, uint, 0444);
+MODULE_PARM_DESC(pulses, "Concurrent test: pulses by each writer");
+
+/* Checks done */
+static unsigned int test_checks;
+/* Checks failed */
+static unsigned int test_failures;
+
+/**
+ * Check value
+ * 
+ * @param test - test name
+ * @param name - value name
+ * @param value
+ * @param expected
+ */
+static void test_expect(const char *test, 
+                        const char *name, 
+                        u64 value, 
+                        u64 expected) {
+    test_checks++;
+    
+    if(value != expected) {
+        test_failures++;
+        
+        pr_alert("%s: %s = %llu, expected %llu\n", 
+                 test, 
+                 name, 
+                 (unsigned long long)value, 
+                 (unsigned long long)expected);
+    }
+}
+
+#define TEST_EXPECT(name, value, expected) \
+    test_expect(__func__, name, value, expected)
+
+/**
+ * Queue pulse the same way as the driver's IRQ handler
+ * 
+ * @param dev
+ * @param timestamp
+ * @return false, if pulse will be counted without timestamp
+ */
+static bool test_inject(struct counters_device *dev, u64 timestamp) {
+    unsigned long flags;
+    bool queued;
+    
+    /* Don't hold reserved queue slot while preempted */
+    local_irq_save(flags);
+    
+    queued = counters_queue_pulse(dev, timestamp, COUNTERS_EDGE_UNKNOWN);
+    
+    local_irq_restore(flags);
+    
+    return queued;
+}
+
+/**
+ * Inject pulses with the regular period and account them
+ * 
+ * @param dev
+ * @param start - first timestamp (ns)
+ * @param period - period (ns)
+ * @param count - pulses count (up to the queue size)
+ */
+static void test_train(struct counters_device *dev, 
+                       u64 start, 
+                       u64 period, 
+                       unsigned int count) {
+    unsigned int i;
+    
+    for(i = 0; i < count; i++) {
+        test_inject(dev, start + i * period);
+    }
+    
+    counters_flush_pulses(dev);
+}
+
+/**
+ * Allocate not registered device for the test
+ * 
+ * @param name
+ * @return device or NULL
+ */
+static struct counters_device *test_device(const char *name) {
+    struct counters_device *dev = counters_allocate_device(name, 0);
+    
+    if(IS_ERR_OR_NULL(dev)) {
+        pr_alert("%s: unable to allocate device\n", name);
+        
+        test_failures++;
+        
+        return NULL;
+    }
+    
+    return dev;
+}
+
+/**
+ * Pulses count and periods of the regular pulse train
+ */
+static void test_counting(void) {
+    struct counters_device *dev = test_device("test-counting");
+    struct counters_snapshot snapshot;
+    
+    if(!dev) {
+        return;
+    }
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("initial count", snapshot.count, 0);
+    TEST_EXPECT("initial average", snapshot.average_pulse_period, 0);
+    
+    test_train(dev, TEST_START_NS, TEST_PERIOD_NS, 10);
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("count", snapshot.count, 10);
+    TEST_EXPECT("last period", snapshot.last_pulse_period, TEST_PERIOD_NS);
+    TEST_EXPECT("average period", snapshot.average_pulse_period, TEST_PERIOD_NS);
+    TEST_EXPECT("last pulse", snapshot.last_pulse, TEST_START_NS + 9 * TEST_PERIOD_NS);
+    
+    counters_free_device(dev);
+}
+
+/**
+ * Period maths: equal and non-monotonic timestamps, window overflow
+ */
+static void test_periods(void) {
+    struct counters_device *dev = test_device("test-periods");
+    struct counters_snapshot snapshot;
+    
+    if(!dev) {
+        return;
+    }
+    
+    /* Equal timestamps: zero period */
+    test_train(dev, TEST_START_NS, 0, 2);
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("equal: count", snapshot.count, 2);
+    TEST_EXPECT("equal: last period", snapshot.last_pulse_period, 0);
+    TEST_EXPECT("equal: average period", snapshot.average_pulse_period, 0);
+    
+    counters_free_device(dev);
+    
+    dev = test_device("test-periods");
+    
+    if(!dev) {
+        return;
+    }
+    
+    /* Timestamp before the previous one: zero period, mean by the window span */
+    test_inject(dev, TEST_START_NS);
+    test_inject(dev, TEST_START_NS + 2 * TEST_PERIOD_NS);
+    test_inject(dev, TEST_START_NS + TEST_PERIOD_NS);
+    counters_flush_pulses(dev);
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("backward: count", snapshot.count, 3);
+    TEST_EXPECT("backward: last period", snapshot.last_pulse_period, 0);
+    TEST_EXPECT("backward: average period", snapshot.average_pulse_period, TEST_PERIOD_NS / 2);
+    
+    counters_free_device(dev);
+    
+    dev = test_device("test-periods");
+    
+    if(!dev) {
+        return;
+    }
+    
+    /* Window keep the last COUNTERS_WINDOW_SIZE timestamps */
+    test_train(dev, TEST_START_NS, TEST_PERIOD_NS, COUNTERS_WINDOW_SIZE + 8);
+    test_train(dev, 
+               TEST_START_NS + (COUNTERS_WINDOW_SIZE + 10) * TEST_PERIOD_NS, 
+               0, 
+               1);
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("window: count", snapshot.count, COUNTERS_WINDOW_SIZE + 9);
+    TEST_EXPECT("window: last period", snapshot.last_pulse_period, 3 * TEST_PERIOD_NS);
+    TEST_EXPECT("window: average period", 
+                snapshot.average_pulse_period, 
+                div_u64((COUNTERS_WINDOW_SIZE + 1) * TEST_PERIOD_NS, COUNTERS_WINDOW_SIZE - 1));
+    
+    counters_free_device(dev);
+}
+
+/**
+ * Clock change reset periods, but keep count
+ */
+static void test_clock(void) {
+    struct counters_device *dev = test_device("test-clock");
+    struct counters_snapshot snapshot;
+    
+    if(!dev) {
+        return;
+    }
+    
+    TEST_EXPECT("unsupported clock", 
+                (u64)counters_set_clock(dev, CLOCK_REALTIME), 
+                (u64)-EINVAL);
+    
+    test_train(dev, TEST_START_NS, TEST_PERIOD_NS, 5);
+    
+    TEST_EXPECT("set clock", (u64)counters_set_clock(dev, CLOCK_MONOTONIC_RAW), 0);
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("changed: count", snapshot.count, 5);
+    TEST_EXPECT("changed: last pulse", snapshot.last_pulse, 0);
+    TEST_EXPECT("changed: average period", snapshot.average_pulse_period, 0);
+    
+    /* New clock timestamps can be less than the old ones */
+    test_train(dev, TEST_PERIOD_NS, 2 * TEST_PERIOD_NS, 3);
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("new clock: count", snapshot.count, 8);
+    TEST_EXPECT("new clock: last period", snapshot.last_pulse_period, 2 * TEST_PERIOD_NS);
+    TEST_EXPECT("new clock: average period", snapshot.average_pulse_period, 2 * TEST_PERIOD_NS);
+    
+    counters_free_device(dev);
+}
+
+/**
+ * Full pulse queue: pulses are counted without timestamps
+ */
+static void test_lost(void) {
+    struct counters_device *dev = test_device("test-lost");
+    struct counters_snapshot snapshot;
+    unsigned int queued = 0;
+    unsigned int i;
+    
+    if(!dev) {
+        return;
+    }
+    
+    for(i = 0; i < 1000; i++) {
+        queued += test_inject(dev, TEST_START_NS + i * TEST_PERIOD_NS);
+    }
+    
+    TEST_EXPECT("queue overflow", queued < 1000, 1);
+    
+    counters_flush_pulses(dev);
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("count", snapshot.count, 1000);
+    TEST_EXPECT("window restart", snapshot.average_pulse_period, 0);
+    
+    test_train(dev, TEST_START_NS + 1000 * TEST_PERIOD_NS, TEST_PERIOD_NS, 2);
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("count after", snapshot.count, 1002);
+    TEST_EXPECT("average after", snapshot.average_pulse_period, TEST_PERIOD_NS);
+    
+    counters_free_device(dev);
+}
+
+/**
+ * Concurrent test writer: inject and account pulses
+ * 
+ * @param data - struct counters_test_thread
+ * @return 
+ */
+static int test_writer(void *data) {
+    struct counters_test_thread *thread = data;
+    struct counters_device *dev = thread->dev;
+    unsigned int i;
+    
+    for(i = 0; i < pulses; i++) {
+        test_inject(dev, counters_timestamp(dev));
+        
+        if(!((i + 1) % TEST_BATCH) || i + 1 == pulses) {
+            counters_flush_pulses(dev);
+            
+            cond_resched();
+        }
+    }
+    
+    thread->count = pulses;
+    
+    complete(&thread->done);
+    
+    while(!kthread_should_stop()) {
+        schedule_timeout_interruptible(HZ / 10);
+    }
+    
+    return 0;
+}
+
+/**
+ * Concurrent test reader: lockless snapshots must be consistent
+ * 
+ * @param data - struct counters_test_thread
+ * @return 
+ */
+static int test_reader(void *data) {
+    struct counters_test_thread *thread = data;
+    struct counters_snapshot snapshot;
+    u64 total = (u64)writers * pulses;
+    u64 last = 0;
+    
+    while(!kthread_should_stop()) {
+        counters_snapshot(thread->dev, &snapshot);
+        
+        if(snapshot.count < last || snapshot.count > total) {
+            thread->errors++;
+        }
+        
+        last = snapshot.count;
+        thread->count++;
+        
+        cond_resched();
+    }
+    
+    return 0;
+}
+
+/**
+ * Concurrent pulse injection against the readers, throughput report
+ */
+static void test_concurrent(void) {
+    struct counters_device *dev = test_device("test-concurrent");
+    struct counters_test_thread *threads;
+    struct counters_snapshot snapshot;
+    unsigned int n = writers + readers;
+    u64 batches;
+    u64 accounted;
+    u64 lost;
+    u64 snapshots = 0;
+    unsigned int errors = 0;
+    u64 start;
+    u64 elapsed;
+    unsigned int i;
+    
+    if(!dev) {
+        return;
+    }
+    
+    threads = kcalloc(n, sizeof(struct counters_test_thread), GFP_KERNEL);
+    
+    if(!threads) {
+        test_failures++;
+        
+        counters_free_device(dev);
+        
+        return;
+    }
+    
+    start = ktime_get_ns();
+    
+    for(i = 0; i < n; i++) {
+        struct task_struct *task;
+        
+        threads[i].dev = dev;
+        init_completion(&threads[i].done);
+        
+        task = (i < writers) ?
+            kthread_run(test_writer, &threads[i], "counters-test-w%u", i) :
+            kthread_run(test_reader, &threads[i], "counters-test-r%u", i - writers);
+        
+        if(IS_ERR(task)) {
+            pr_alert("Unable to start thread %u\n", i);
+            
+            test_failures++;
+            
+            if(i < writers) {
+                /* Nobody will inject these pulses */
+                complete(&threads[i].done);
+            }
+        } else {
+            threads[i].task = task;
+        }
+    }
+    
+    for(i = 0; i < writers; i++) {
+        wait_for_completion(&threads[i].done);
+    }
+    
+    elapsed = ktime_get_ns() - start;
+    
+    for(i = 0; i < n; i++) {
+        if(threads[i].task) {
+            kthread_stop(threads[i].task);
+        }
+        
+        if(i >= writers) {
+            snapshots += threads[i].count;
+            errors += threads[i].errors;
+        }
+    }
+    
+    counters_snapshot(dev, &snapshot);
+    
+    TEST_EXPECT("count", snapshot.count, (u64)writers * pulses);
+    TEST_EXPECT("inconsistent snapshots", errors, 0);
+    
+    spin_lock(&dev->measurements_lock);
+    
+    batches = dev->flush_batches;
+    accounted = dev->flush_pulses;
+    lost = dev->flush_lost;
+    
+    spin_unlock(&dev->measurements_lock);
+    
+    pr_info("%u writers, %u readers: %llu pulses in %llu us, %llu pulses/s\n", 
+            writers, 
+            readers, 
+            (unsigned long long)snapshot.count, 
+            (unsigned long long)div_u64(elapsed, NSEC_PER_USEC), 
+            (unsigned long long)(elapsed ? div64_u64(snapshot.count * NSEC_PER_SEC, elapsed) : 0));
+    pr_info("flush: %llu batches, %llu pulses, %llu lost, %llu snapshots\n", 
+            (unsigned long long)batches, 
+            (unsigned long long)accounted, 
+            (unsigned long long)lost, 
+            (unsigned long long)snapshots);
+    
+    kfree(threads);
+    
+    counters_free_device(dev);
+}
+
+static int __init counters_test_init(void)
+{
+    test_counting();
+    test_periods();
+    test_clock();
+    test_lost();
+    test_concurrent();
+    
+    pr_info("%u of %u checks passed\n", test_checks - test_failures, test_checks);
+    
+    return test_failures ? -EINVAL : 0;
+}
+
+static void __exit counters_test_exit(void)
+{
+}
+
+
+module_init(counters_test_init)
+module_exit(counters_test_exit)
+
+MODULE_LICENSE("GPL v2");
+MODULE_AUTHOR(DRIVER_AUTHOR);
+MODULE_DESCRIPTION(DRIVER_DESC);
+MODULE_VERSION(DRIVER_VERSION);
@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# Class core throughput test by the counters-sim pulse trains.
+#
+# Usage: counters-throughput.sh [-d seconds] [-n instances] [-m counters-sim.ko] [rate_hz ...]
+#
+# For each rate simulated counters are registered for the given duration,
+# then pulses, which lost timestamps by the pulse queue overflow (the "lost"
+# field of stats/flush), are reported with CPU time, spent above the idle
+# baseline (/proc/stat). Pulses are queued by hrtimers directly to the class,
+# so limits of the gpio-pulse IRQ and polling paths are not measured.
+#
+
+DURATION=5
+INSTANCES=100
+MODULE=./counters-sim.ko
+CLASS=/sys/class/counters
+PARAMS=/sys/module/counters_sim/parameters
+
+while getopts "d:n:m:" OPT; do
+    case $OPT in
+        d) DURATION=$OPTARG ;;
+        n) INSTANCES=$OPTARG ;;
+        m) MODULE=$OPTARG ;;
+        *) echo "Usage: $0 [-d seconds] [-n instances] [-m counters-sim.ko] [rate_hz ...]" >&2
+           exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+RATES=${*:-"1000 10000 50000 100000"}
+
+if [ ! -d $CLASS ]; then
+    echo "$CLASS not found, load counters.ko first" >&2
+    exit 1
+fi
+
+if [ ! -f $MODULE ]; then
+    echo "$MODULE not found" >&2
+    exit 1
+fi
+
+# Busy and total CPU time (jiffies) of all CPUs.
+# NOTE: irq and softirq are accounted only with CONFIG_IRQ_TIME_ACCOUNTING.
+cpu_time() {
+    awk '/^cpu / { print $2 + $3 + $4 + $7 + $8 + $9, $2 + $3 + $4 + $5 + $6 + $7 + $8 + $9 }' /proc/stat
+}
+
+# Busy fraction of all CPUs (x 10^6) during the given seconds
+cpu_load() {
+    set -- $(cpu_time) $1
+    BUSY=$1
+    TOTAL=$2
+    sleep $3
+    set -- $(cpu_time)
+    echo $(( (($1 - BUSY) * 1000000) / ($2 - TOTAL + 1) ))
+}
+
+# Sum of the values/count and of the lost field of stats/flush of sim counters
+counted() {
+    COUNT=0
+    LOST=0
+    for COUNTER in $CLASS/*; do
+        case $(cat $COUNTER/name) in
+            sim*) ;;
+            *) continue ;;
+        esac
+        COUNT=$((COUNT + $(cat $COUNTER/values/count)))
+        set -- $(cat $COUNTER/stats/flush)
+        LOST=$((LOST + $3))
+    done
+    echo $COUNT $LOST
+}
+
+BASELINE=$(cpu_load $DURATION)
+
+printf "%10s %10s %12s %12s %10s %8s\n" rate_hz instances generated counted lost cpu_%
+
+for RATE in $RATES; do
+    set -- $(cpu_time)
+    BUSY=$1
+    TOTAL=$2
+
+    insmod $MODULE instances=$INSTANCES rate=$RATE duration_ms=$((DURATION * 1000)) || exit 1
+    # Trains are finished, let the flush work to drain the queues
+    sleep $((DURATION + 1))
+
+    set -- $(cpu_time)
+    LOAD=$(( (($1 - BUSY) * 1000000) / ($2 - TOTAL + 1) - BASELINE ))
+    [ $LOAD -lt 0 ] && LOAD=0
+
+    GENERATED=$(cat $PARAMS/generated)
+    set -- $(counted)
+
+    rmmod counters_sim
+
+    printf "%10s %10s %12s %12s %10s %5d.%02d\n" $RATE $INSTANCES $GENERATED $1 $2 \
+        $((LOAD / 10000)) $((LOAD / 100 % 100))
+done
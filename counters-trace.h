@@ -0,0 +1,121 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM counters
+
+#if !defined(__COUNTERS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __COUNTERS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "counters.h"
+
+/*
+ * Pulse is accounted (from the deferred part of the pulse processing)
+ */
+TRACE_EVENT(counters_pulse,
+    TP_PROTO(const struct counters_device *dev, u64 timestamp, unsigned int edge),
+    TP_ARGS(dev, timestamp, edge),
+    TP_STRUCT__entry(
+        __field(unsigned int, id)
+        __field(u64, timestamp)
+        __field(unsigned int, edge)
+        __field(u64, count)
+    ),
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->timestamp = timestamp;
+        __entry->edge = edge;
+        __entry->count = dev->pulse_count;
+    ),
+    TP_printk("counter%u timestamp=%llu edge=%u count=%llu",
+              __entry->id,
+              (unsigned long long)__entry->timestamp,
+              __entry->edge,
+              (unsigned long long)__entry->count)
+);
+
+/*
+ * Driver's hard IRQ handler is entered
+ */
+TRACE_EVENT(counters_irq_entry,
+    TP_PROTO(const struct counters_device *dev, int irq),
+    TP_ARGS(dev, irq),
+    TP_STRUCT__entry(
+        __field(unsigned int, id)
+        __field(int, irq)
+    ),
+    TP_fast_assign(
+        __entry->id = dev ? dev->id : UINT_MAX;
+        __entry->irq = irq;
+    ),
+    TP_printk("counter%u irq=%d", __entry->id, __entry->irq)
+);
+
+/*
+ * Driver's hard IRQ handler is finished
+ */
+TRACE_EVENT(counters_irq_exit,
+    TP_PROTO(const struct counters_device *dev, int irq, int ret),
+    TP_ARGS(dev, irq, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, id)
+        __field(int, irq)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->id = dev ? dev->id : UINT_MAX;
+        __entry->irq = irq;
+        __entry->ret = ret;
+    ),
+    TP_printk("counter%u irq=%d ret=%d", __entry->id, __entry->irq, __entry->ret)
+);
+
+/*
+ * Edge is rejected by the driver's filter (i.e. debounce)
+ */
+TRACE_EVENT(counters_reject,
+    TP_PROTO(const struct counters_device *dev, u64 rejected),
+    TP_ARGS(dev, rejected),
+    TP_STRUCT__entry(
+        __field(unsigned int, id)
+        __field(u64, rejected)
+    ),
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->rejected = rejected;
+    ),
+    TP_printk("counter%u rejected=%llu",
+              __entry->id,
+              (unsigned long long)__entry->rejected)
+);
+
+/*
+ * Pulse count is overwritten (by user or by clear_count_when_reading)
+ */
+TRACE_EVENT(counters_reset,
+    TP_PROTO(const struct counters_device *dev, u64 count, u64 value),
+    TP_ARGS(dev, count, value),
+    TP_STRUCT__entry(
+        __field(unsigned int, id)
+        __field(u64, count)
+        __field(u64, value)
+    ),
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->count = count;
+        __entry->value = value;
+    ),
+    TP_printk("counter%u count=%llu value=%llu",
+              __entry->id,
+              (unsigned long long)__entry->count,
+              (unsigned long long)__entry->value)
+);
+
+#endif
+
+/* Trace header is placed outside of the kernel tree */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE counters-trace
+
+#include <trace/define_trace.h>
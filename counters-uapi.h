@@ -0,0 +1,114 @@
+#ifndef __UAPI_LINUX_COUNTERS_H
+#define __UAPI_LINUX_COUNTERS_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Pulse edge, reported in the event record */
+#define COUNTERS_EDGE_UNKNOWN   0
+#define COUNTERS_EDGE_RISING    1
+#define COUNTERS_EDGE_FALLING   2
+
+/* Event record flags */
+/* Reader's queue was overrun, events before this one are lost
+ * (count of lost events is the gap in the sequence numbers) */
+#define COUNTERS_EVENT_OVERRUN  (1 << 0)
+
+/*
+ * Pulse event record, returned by read() from the /dev/counters/counterN
+ */
+struct counters_event {
+    /* Event sequence number (per device, starts from 0) */
+    __u64 seq;
+    /* Event timestamp (ns) by the device's clock */
+    __u64 timestamp;
+    /* Pulse edge (COUNTERS_EDGE_*) */
+    __u32 edge;
+    /* Record flags (COUNTERS_EVENT_*) */
+    __u32 flags;
+};
+
+/*
+ * Shared memory ring of the pulse timestamps, mapped by mmap() on the
+ * /dev/counters/counterN (must be enabled by the "ring_size" attribute).
+ * 
+ * Mapping start from the header, records (__u64 timestamps, ns) placed at the
+ * data_offset. Indexes are free running, record for index i is at the
+ * position i & (size - 1). Consumer must read head with acquire semantic and
+ * publish tail with release semantic. Producer and consumer indexes are
+ * placed at the different cache lines.
+ */
+struct counters_ring_header {
+    /* Ring size (records, power of 2) */
+    __u32 size;
+    /* Record size (bytes) */
+    __u32 record_size;
+    /* Offset of the first record from the mapping start (bytes) */
+    __u32 data_offset;
+    __u32 reserved0[13];
+    /* Producer index, written by kernel */
+    __u32 head;
+    /* Records, dropped because ring was full, written by kernel */
+    __u32 overruns;
+    __u32 reserved1[14];
+    /* Consumer index, written by userspace */
+    __u32 tail;
+    __u32 reserved2[15];
+};
+
+/*
+ * Counter snapshot record, filled by the COUNTERS_IOC_SNAPSHOT
+ */
+struct counters_snapshot {
+    /* Counter number (N at the /dev/counters/counterN) */
+    __u32 id;
+    __u32 reserved;
+    /* Detected pulse count */
+    __u64 count;
+    /* Last pulse period (ns) */
+    __u64 last_pulse_period;
+    /* Average pulse period (ns) */
+    __u64 average_pulse_period;
+    /* Last pulse timestamp (ns) by the counter's clock */
+    __u64 last_pulse;
+};
+
+/*
+ * COUNTERS_IOC_SNAPSHOT argument
+ */
+struct counters_snapshot_request {
+    /* In: records array capacity, out: filled records */
+    __u32 count;
+    /* Out: registered counters total */
+    __u32 total;
+    /* In: pointer to the array of struct counters_snapshot */
+    __u64 records;
+};
+
+/*
+ * Pulse periods histogram, read from the values/histogram binary attribute:
+ * array of __u64 counters, bucket i count periods in [2^i, 2^(i+1)) ns
+ * (bucket 0 also count zero periods). Write to the attribute reset it.
+ */
+#define COUNTERS_HISTOGRAM_BUCKETS  64
+
+/*
+ * Pulse batch record, written to the values/pulse_batch binary attribute as
+ * packed array: count pulses with the timestamp (ns) by the counter's clock
+ */
+struct counters_pulse_record {
+    __u64 timestamp;
+    __u64 count;
+};
+
+/* Max. pulses by the one write to the values/pulse or values/pulse_batch */
+#define COUNTERS_BATCH_MAX      65536
+
+#define COUNTERS_IOC_MAGIC      0xC7
+
+/* Snapshot all registered counters (ioctl on the /dev/counters/control) */
+#define COUNTERS_IOC_SNAPSHOT   _IOWR(COUNTERS_IOC_MAGIC, 1, struct counters_snapshot_request)
+/* Pulses since open() or previous call by this file (ioctl on the /dev/counters/counterN) */
+#define COUNTERS_IOC_DELTA      _IOR(COUNTERS_IOC_MAGIC, 2, __u64)
+
+#endif
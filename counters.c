@@ -5,22 +5,217 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/printk.h>
+#include <linux/math64.h>
+#include <linux/fs.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/idr.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/smp.h>
 
 #include "counters.h"
 
+#define CREATE_TRACE_POINTS
+#include "counters-trace.h"
+
 #define DRIVER_AUTHOR "Igor V. Nikolaev <support@vedga.com>"
 #define DRIVER_DESC   "Pulse counters device class"
 #define DRIVER_VERSION "0.1"
 
-#define USEC_VALUE 1000000
-
 #ifdef pr_fmt
 #undef pr_fmt
 #endif
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+/* Pending pulses queue size (power of 2) */
+#define COUNTERS_QUEUE_SIZE 256
+#define COUNTERS_QUEUE_MASK (COUNTERS_QUEUE_SIZE - 1)
+/* Pending pulses queue is placed at the cache line after the class data */
+#define COUNTERS_QUEUE_OFFSET ALIGN(sizeof(struct counters_device), SMP_CACHE_BYTES)
+
+/*
+ * Pending pulses queue slot
+ */
+struct counters_pulse_slot {
+    /* Slot state: position + 1 if published, position + queue size if free */
+    unsigned int seq;
+    /* Pulse edge (COUNTERS_EDGE_*) */
+    unsigned int edge;
+    /* Pulse timestamp (ns) */
+    u64 timestamp;
+};
+
+/*
+ * Opened character device: pulse events reader
+ */
+struct counters_reader {
+    /* Device, which events are read */
+    struct counters_device *dev;
+    /* Entry at the device's readers list (if subscribed) */
+    struct list_head list;
+    /* Serialize read() calls (kfifo consumer must be single) */
+    struct mutex read_lock;
+    /* Serialize events subscription */
+    struct mutex subscribe_lock;
+    /* Events are queued: set by the first read() or poll(), so consumers of
+     * the delta or the ring don't load the pulse path */
+    bool subscribed;
+    /* Queued events (producer is counters_flush_pulses()) */
+    DECLARE_KFIFO_PTR(events, struct counters_event);
+    /* Event was dropped, next queued event must be marked by the overrun flag */
+    bool overrun;
+    /* Serialize COUNTERS_IOC_DELTA calls */
+    struct mutex delta_lock;
+    /* Device's pulses total at the previous COUNTERS_IOC_DELTA (under delta_lock) */
+    u64 cursor;
+};
+
+/*
+ * Shared memory ring of the pulse timestamps
+ */
+struct counters_ring {
+    /* Ring is used by the device and by each mapping */
+    struct kref ref;
+    /* Mapped area: header page and records (vmalloc_user() memory) */
+    struct counters_ring_header *header;
+    /* Records array */
+    u64 *records;
+    /* Ring size - 1 */
+    u32 mask;
+    /* Producer index (kernel copy, userspace can't corrupt it) */
+    u32 head;
+    /* Dropped records (kernel copy) */
+    u32 overruns;
+    /* Mapped area size (bytes) */
+    size_t length;
+};
+
+/* Handler statistics histogram buckets: bucket i is [2^i, 2^(i+1)) ns */
+#define COUNTERS_STATS_BUCKETS 32
+
+/*
+ * Handler statistics of the one kind
+ */
+struct counters_stats_histogram {
+    /* Samples */
+    u64 count;
+    /* Min. value (ns) */
+    u64 min;
+    /* Max. value (ns) */
+    u64 max;
+    /* Samples by the log2 buckets */
+    u32 buckets[COUNTERS_STATS_BUCKETS];
+};
+
+/*
+ * Handler statistics (per CPU part)
+ */
+struct counters_stats {
+    /* Histograms by kind (COUNTERS_STATS_*) */
+    struct counters_stats_histogram kinds[COUNTERS_STATS_KINDS];
+    /* Readers of the 64-bit values on 32-bit platforms */
+    struct u64_stats_sync syncp;
+};
+
+/*
+ * Pulse period statistics, computed from the raw timestamps window
+ */
+struct counters_period_stats {
+    /* Last pulse period (ns) */
+    u64 last;
+    /* Mean period over the window (ns) */
+    u64 average;
+    /* Min. period at the window (ns) */
+    u64 min;
+    /* Max. period at the window (ns) */
+    u64 max;
+};
+
+/*
+ * COUNTERS_IOC_SNAPSHOT traversal context
+ */
+struct counters_snapshot_context {
+    /* User's records array */
+    struct counters_snapshot __user *records;
+    /* User's records array capacity */
+    u32 capacity;
+    /* Filled records */
+    u32 count;
+    /* Registered counters */
+    u32 total;
+};
+
 /* Forwarding functions declarations */
 static char *counters_devnode(struct device *dev, umode_t *mode);
+static int counters_fop_open(struct inode *inode, struct file *file);
+static int counters_fop_release(struct inode *inode, struct file *file);
+static ssize_t counters_fop_read(struct file *file, 
+                                 char __user *buf, 
+                                 size_t count, 
+                                 loff_t *ppos);
+static unsigned int counters_fop_poll(struct file *file, 
+                                      struct poll_table_struct *wait);
+static long counters_fop_ioctl(struct file *file, 
+                               unsigned int cmd, 
+                               unsigned long arg);
+static u64 counters_pulse_total(struct counters_device *dev);
+static int counters_fop_mmap(struct file *file, struct vm_area_struct *vma);
+static long counters_control_ioctl(struct file *file, 
+                                   unsigned int cmd, 
+                                   unsigned long arg);
+static unsigned int counters_window_copy(const struct counters_device *dev, 
+                                         u64 *timestamps);
+static void counters_window_stats(const u64 *timestamps, 
+                                  unsigned int n, 
+                                  struct counters_period_stats *stats);
+static void counters_period_stats(struct counters_device *dev, 
+                                  struct counters_period_stats *stats);
+static void counters_window_restart(struct counters_device *dev);
+static void counters_rate_account(struct counters_device *dev, 
+                                  u64 timestamp, 
+                                  unsigned int pulses);
+static ssize_t rate_show(struct device *device, 
+                         struct device_attribute *attr, 
+                         char *buf);
+static void counters_width_stats(struct counters_device *dev, 
+                                 u64 *width, 
+                                 u64 *space);
+static ssize_t pulse_width_show(struct device *device, 
+                                struct device_attribute *attr, 
+                                char *buf);
+static ssize_t pulse_space_show(struct device *device, 
+                                struct device_attribute *attr, 
+                                char *buf);
+static ssize_t duty_cycle_show(struct device *device, 
+                               struct device_attribute *attr, 
+                               char *buf);
+static void counters_flush_work(struct work_struct *work);
+static void counters_flush_queue(struct counters_device *dev);
+static void counters_ring_release(struct kref *ref);
+static void counters_ring_vm_open(struct vm_area_struct *vma);
+static void counters_ring_vm_close(struct vm_area_struct *vma);
+static ssize_t ring_size_show(struct device *device, 
+                              struct device_attribute *attr, 
+                              char *buf);
+static ssize_t ring_size_store(struct device *device, 
+                               struct device_attribute *attr, 
+                               const char *buf, 
+                               size_t size);
+static ssize_t cpu_show(struct device *device, 
+                        struct device_attribute *attr, 
+                        char *buf);
+static ssize_t cpu_store(struct device *device, 
+                         struct device_attribute *attr, 
+                         const char *buf, 
+                         size_t size);
 static ssize_t clear_count_when_reading_show(struct class *class, 
                                              struct class_attribute *attr, 
                                              char *buf);
@@ -32,6 +227,13 @@ static void counters_device_release(struct device *device);
 static ssize_t name_show(struct device *device, 
                          struct device_attribute *attr, 
                          char *buf);
+static ssize_t clock_show(struct device *device, 
+                          struct device_attribute *attr, 
+                          char *buf);
+static ssize_t clock_store(struct device *device, 
+                           struct device_attribute *attr, 
+                           const char *buf, 
+                           size_t size);
 static ssize_t pulse_store(struct device *device, 
                            struct device_attribute *attr, 
                            const char *buf, 
@@ -53,26 +255,170 @@ static ssize_t last_pulse_period_store(struct device *device,
 static ssize_t average_pulse_period_show(struct device *device, 
                                          struct device_attribute *attr, 
                                          char *buf);
+static ssize_t min_pulse_period_show(struct device *device, 
+                                     struct device_attribute *attr, 
+                                     char *buf);
+static ssize_t max_pulse_period_show(struct device *device, 
+                                     struct device_attribute *attr, 
+                                     char *buf);
+static ssize_t rejected_show(struct device *device, 
+                             struct device_attribute *attr, 
+                             char *buf);
+static ssize_t histogram_read(struct file *file, 
+                              struct kobject *kobj, 
+                              struct bin_attribute *attr, 
+                              char *buf, 
+                              loff_t pos, 
+                              size_t count);
+static ssize_t histogram_write(struct file *file, 
+                               struct kobject *kobj, 
+                               struct bin_attribute *attr, 
+                               char *buf, 
+                               loff_t pos, 
+                               size_t count);
+static ssize_t pulse_batch_write(struct file *file, 
+                                 struct kobject *kobj, 
+                                 struct bin_attribute *attr, 
+                                 char *buf, 
+                                 loff_t pos, 
+                                 size_t count);
 static ssize_t average_pulse_period_store(struct device *device, 
                                           struct device_attribute *attr, 
                                           const char *buf, 
                                           size_t size);
-static int timeval_subtract(struct timeval *result, 
-                            struct timeval  *x, 
-                            struct timeval  *y);
+static ssize_t collect_stats_show(struct class *class, 
+                                  struct class_attribute *attr, 
+                                  char *buf);
+static ssize_t collect_stats_store(struct class *class, 
+                                   struct class_attribute *attr, 
+                                   const char *buf, 
+                                   size_t size);
+static ssize_t isr_show(struct device *device, 
+                        struct device_attribute *attr, 
+                        char *buf);
+static ssize_t latency_show(struct device *device, 
+                            struct device_attribute *attr, 
+                            char *buf);
+static ssize_t defer_show(struct device *device, 
+                          struct device_attribute *attr, 
+                          char *buf);
+static ssize_t reset_store(struct device *device, 
+                           struct device_attribute *attr, 
+                           const char *buf, 
+                           size_t size);
+static ssize_t flush_show(struct device *device, 
+                          struct device_attribute *attr, 
+                          char *buf);
 
+/* Handler statistics collection is enabled */
+DEFINE_STATIC_KEY_FALSE(counters_stats_key);
+EXPORT_SYMBOL_GPL(counters_stats_key);
 
 /* Clear conters when value is readed */
 static int clear_count_when_reading = 0;
 
+/* Per-reader event queue size (records) */
+static unsigned int event_queue_size = 256;
+module_param(event_queue_size, uint, 0644);
+MODULE_PARM_DESC(event_queue_size, "Per-reader pulse event queue size (records)");
+
+/* Character devices region */
+static dev_t counters_devt;
+
+/* Class data (struct counters_device), cache line aligned */
+static struct kmem_cache *counters_device_cache;
+
+/* Counter numbers: allocated device or NULL, registered device (by id) */
+static DEFINE_IDR(counters_idr);
+/* Serialize counters_idr updates and lookups */
+static DEFINE_SPINLOCK(counters_idr_lock);
+
+/* Character device operations */
+static const struct file_operations counters_fops = {
+    .owner          = THIS_MODULE,
+    .open           = counters_fop_open,
+    .release        = counters_fop_release,
+    .read           = counters_fop_read,
+    .poll           = counters_fop_poll,
+    .mmap           = counters_fop_mmap,
+    .unlocked_ioctl = counters_fop_ioctl,
+    .compat_ioctl   = counters_fop_ioctl,
+    .llseek         = no_llseek,
+};
+
+/* Pulse rate windows length (ns) */
+static const u64 counters_rate_windows[COUNTERS_RATE_WINDOWS] = {
+    1ULL * NSEC_PER_SEC,
+    10ULL * NSEC_PER_SEC,
+    60ULL * NSEC_PER_SEC,
+    900ULL * NSEC_PER_SEC,
+};
+
+/* Clocks, which may be used for pulse timestamps */
+static const struct {
+    const char *name;
+    clockid_t id;
+} counters_clocks[] = {
+    { "monotonic",      CLOCK_MONOTONIC },
+    { "monotonic_raw",  CLOCK_MONOTONIC_RAW },
+    { "boottime",       CLOCK_BOOTTIME },
+    { "tai",            CLOCK_TAI },
+};
+
+/* Control device operations */
+static const struct file_operations counters_control_fops = {
+    .owner          = THIS_MODULE,
+    .open           = nonseekable_open,
+    .unlocked_ioctl = counters_control_ioctl,
+    .compat_ioctl   = counters_control_ioctl,
+    .llseek         = no_llseek,
+};
+
+/* Control device /dev/counters/control */
+static struct miscdevice counters_control = {
+    .minor          = MISC_DYNAMIC_MINOR,
+    .name           = DEVICE_CLASS "-" CONTROL_NAME,
+    .nodename       = DEVICE_CLASS "/" CONTROL_NAME,
+    .fops           = &counters_control_fops,
+};
+
+/* Shared memory ring mapping operations */
+static const struct vm_operations_struct counters_ring_vm_ops = {
+    .open           = counters_ring_vm_open,
+    .close          = counters_ring_vm_close,
+};
+
 /* Root device attributes */
 static DEVICE_ATTR_RO(name);
+static DEVICE_ATTR_RW(clock);
+static DEVICE_ATTR_RW(ring_size);
+static DEVICE_ATTR_RW(cpu);
+
+/* Attributes at the root of the each device */
+static struct attribute *counters_device_attributes[] = {
+    &dev_attr_clock.attr,
+    &dev_attr_ring_size.attr,
+    &dev_attr_cpu.attr,
+    NULL
+};
+
+/* Root device attribute group */
+static const struct attribute_group counters_device_root = {
+    .attrs = counters_device_attributes,
+};
 
 /* Device attributes in the group "values" */
 static DEVICE_ATTR_WO(pulse); 
 static DEVICE_ATTR_RW(count); 
 static DEVICE_ATTR_RW(last_pulse_period); 
 static DEVICE_ATTR_RW(average_pulse_period); 
+static DEVICE_ATTR_RO(min_pulse_period); 
+static DEVICE_ATTR_RO(max_pulse_period); 
+static DEVICE_ATTR_RO(rate); 
+static DEVICE_ATTR_RO(pulse_width); 
+static DEVICE_ATTR_RO(pulse_space); 
+static DEVICE_ATTR_RO(duty_cycle); 
+static DEVICE_ATTR_RO(rejected); 
 
 /* Attributes at the "values" group for device drivers */
 static struct attribute *counters_device_values_attributes[] = {
@@ -80,6 +426,24 @@ static struct attribute *counters_device_values_attributes[] = {
     &dev_attr_count.attr,
     &dev_attr_last_pulse_period.attr,
     &dev_attr_average_pulse_period.attr,
+    &dev_attr_min_pulse_period.attr,
+    &dev_attr_max_pulse_period.attr,
+    &dev_attr_rate.attr,
+    &dev_attr_pulse_width.attr,
+    &dev_attr_pulse_space.attr,
+    &dev_attr_duty_cycle.attr,
+    &dev_attr_rejected.attr,
+    NULL
+};
+
+/* Binary attributes in the group "values" */
+static BIN_ATTR_RW(histogram, COUNTERS_HISTOGRAM_BUCKETS * sizeof(u64));
+static __BIN_ATTR(pulse_batch, 0200, NULL, pulse_batch_write, 0);
+
+/* Binary attributes at the "values" group */
+static struct bin_attribute *counters_device_values_bin_attributes[] = {
+    &bin_attr_histogram,
+    &bin_attr_pulse_batch,
     NULL
 };
 
@@ -87,11 +451,37 @@ static struct attribute *counters_device_values_attributes[] = {
 static const struct attribute_group counters_device_values = {
     .name = "values",
     .attrs = counters_device_values_attributes,
+    .bin_attrs = counters_device_values_bin_attributes,
+};
+
+/* Device attributes in the group "stats" */
+static DEVICE_ATTR_RO(isr); 
+static DEVICE_ATTR_RO(latency); 
+static DEVICE_ATTR_RO(defer); 
+static DEVICE_ATTR_WO(reset); 
+static DEVICE_ATTR_RO(flush); 
+
+/* Attributes at the "stats" group */
+static struct attribute *counters_device_stats_attributes[] = {
+    &dev_attr_isr.attr,
+    &dev_attr_latency.attr,
+    &dev_attr_defer.attr,
+    &dev_attr_reset.attr,
+    &dev_attr_flush.attr,
+    NULL
+};
+
+/* Handler statistics attribute group */
+static const struct attribute_group counters_device_stats = {
+    .name = "stats",
+    .attrs = counters_device_stats_attributes,
 };
 
 /* Attribute groups for each device driver for this device class */
 static const struct attribute_group *counters_device_attr_groups[] = {
+    &counters_device_root,
     &counters_device_values,
+    &counters_device_stats,
     NULL
 };
 
@@ -106,6 +496,7 @@ static struct device_type counters_device_type = {
 /* Attributes for device class */
 static struct class_attribute counters_class_attrs[] = {
         __ATTR_RW(clear_count_when_reading),
+        __ATTR_RW(collect_stats),
         __ATTR_NULL,
 };
 
@@ -117,6 +508,10 @@ struct class counters_class = {
 };
 EXPORT_SYMBOL_GPL(counters_class);
 
+/* Tracepoints, used by the device drivers */
+EXPORT_TRACEPOINT_SYMBOL_GPL(counters_irq_entry);
+EXPORT_TRACEPOINT_SYMBOL_GPL(counters_irq_exit);
+
 /**
  * Allocate resource for device drivers
  * 
@@ -127,36 +522,57 @@ EXPORT_SYMBOL_GPL(counters_class);
  * For release allocated by this function resource you must use:
  * counters_free_device(), if device still not registered;
  * counters_unregister_device(), if device is registered by counters_register_device()
+ * Class data and pending pulses queue are the one object of the cache line
+ * aligned counters_device_cache, name and driver's private data
+ * (dev_get_drvdata()) are placed at the one allocation, so private data must
+ * not be freed by the driver.
  */
 struct counters_device *counters_allocate_device(const char* name, 
                                                  size_t driver_private_data_size) {
-    static atomic_t counter_no = ATOMIC_INIT(-1);
-    void *pvt = driver_private_data_size ? kzalloc(driver_private_data_size, GFP_KERNEL) : NULL;
+    /* Private data follow the name with kmalloc() alignment */
+    size_t pvt_offset = ALIGN(strlen(name) + 1, ARCH_KMALLOC_MINALIGN);
     struct counters_device *dev;
+    char *data;
+    int no;
+    unsigned int i;
 
-    if(pvt) {
-        pr_devel("Allocated driver's private data: %pK\n", pvt);
-    } else {
-        if(driver_private_data_size) {
-            pr_alert("Unable to allocate private driver's memory\n");
-
-            return ERR_PTR(-ENOMEM);
-        }
-    }
-    
-    dev = kzalloc(sizeof(struct counters_device), GFP_KERNEL);
+    /* Class data */
+    dev = kmem_cache_zalloc(counters_device_cache, GFP_KERNEL);
 
     if(dev) {
-        /* Store physical resource name */
-        dev->name = kstrdup_const(name, GFP_KERNEL);
+        /* Name and driver's private data */
+        data = kzalloc(pvt_offset + driver_private_data_size, GFP_KERNEL);
+        
+        if(data) {
+            /* Store physical resource name */
+            dev->name = strcpy(data, name);
+        }
+        
+        /* Pending pulses queue (zeroed with the class data) */
+        dev->queue = (struct counters_pulse_slot *)((char *)dev + COUNTERS_QUEUE_OFFSET);
+        /* Handler statistics (zeroed) */
+        dev->stats = alloc_percpu(struct counters_stats);
         
-        if(!dev->name) {
-            if(pvt) {
-                /* Free allocated resources */
-                kfree(pvt);
+        /* Lowest free counter number, device is visible by lookup after registration */
+        idr_preload(GFP_KERNEL);
+        spin_lock(&counters_idr_lock);
+        
+        no = idr_alloc(&counters_idr, NULL, 0, 0, GFP_NOWAIT);
+        
+        spin_unlock(&counters_idr_lock);
+        idr_preload_end();
+        
+        if(no < 0 || !data || !dev->stats) {
+            if(no >= 0) {
+                spin_lock(&counters_idr_lock);
+                idr_remove(&counters_idr, no);
+                spin_unlock(&counters_idr_lock);
             }
             
-            kfree(dev);
+            /* Free allocated resources */
+            free_percpu(dev->stats);
+            kfree(data);
+            kmem_cache_free(counters_device_cache, dev);
             
             pr_alert("Unable to allocate memory for device class data\n");
 
@@ -170,27 +586,50 @@ struct counters_device *counters_allocate_device(const char* name,
         device_initialize(&dev->dev);
 
         /* Формируем уникальное имя для создаваемого устройства */
-        dev_set_name(&dev->dev, 
-                     "%s%lu", 
-                     DEVICE_NAME, (unsigned long)atomic_inc_return(&counter_no));
+        dev_set_name(&dev->dev, "%s%d", DEVICE_NAME, no);
+        dev->id = no;
+        
+        if(no < COUNTERS_MAX_DEVICES) {
+            /* Device will have character device node */
+            dev->dev.devt = MKDEV(MAJOR(counters_devt), no);
+        } else {
+            pr_alert("No character device for %s, only %u counters can have it\n", 
+                     dev_name(&dev->dev), 
+                     COUNTERS_MAX_DEVICES);
+        }
 
         /* Set area for private driver's data */
-        dev_set_drvdata(&dev->dev, pvt);
+        dev_set_drvdata(&dev->dev, driver_private_data_size ? data + pvt_offset : NULL);
         
         // Инициализация критической секции для доступа к результатам измерений
         spin_lock_init(&dev->measurements_lock);
+        seqcount_init(&dev->timing_seq);
+        
+        /* Pulse events readers */
+        INIT_LIST_HEAD(&dev->readers);
+        init_waitqueue_head(&dev->events_wait);
+        
+        /* All queue slots are free */
+        for(i = 0; i < COUNTERS_QUEUE_SIZE; i++) {
+            dev->queue[i].seq = i;
+        }
+        
+        INIT_WORK(&dev->flush_work, counters_flush_work);
+        
+        /* Pulse timestamps by default is CLOCK_MONOTONIC */
+        dev->clock_id = CLOCK_MONOTONIC;
         
-        // Кол-во подсчитанных импульсов на устройстве
-        dev->pulse_count = 0ul;
+        /* Pulses are processed by any CPU */
+        dev->cpu = -1;
+        mutex_init(&dev->cpu_lock);
+        
+        for_each_possible_cpu(i) {
+            u64_stats_init(&per_cpu_ptr(dev->stats, i)->syncp);
+        }
         
         /* Т.к. используются данные нашего модуля, увеличим кол-во ссылок на него  */
         __module_get(THIS_MODULE);
     } else {
-        if(pvt) {
-            /* Free allocated resources */
-            kfree(pvt);
-        }
-        
         pr_alert("Unable to allocate memory for device class data\n");
         
         return ERR_PTR(-ENOMEM);
@@ -231,17 +670,92 @@ int counters_register_device(struct counters_device *dev) {
 
     pr_devel("Register class device: %pK\n", dev);
     
+    if(dev->dev.devt) {
+        /* Character device for pulse events, it hold reference to the device */
+        cdev_init(&dev->cdev, &counters_fops);
+        dev->cdev.owner = THIS_MODULE;
+        dev->cdev.kobj.parent = &dev->dev.kobj;
+        
+        rc = cdev_add(&dev->cdev, dev->dev.devt, 1);
+        
+        if(rc) {
+            pr_alert("Unable to add character device\n");
+            
+            return rc;
+        }
+    }
+    
     rc = device_add(&dev->dev);
 
-    if(!rc) {
+    if(rc) {
+        if(dev->dev.devt) {
+            cdev_del(&dev->cdev);
+        }
+    } else {
         /* Create attribute "name" for this device */
         rc = device_create_file(&dev->dev, &dev_attr_name);
+        
+        if(rc) {
+            /* Device isn't registered, it can be freed by the caller */
+            device_del(&dev->dev);
+            
+            if(dev->dev.devt) {
+                cdev_del(&dev->cdev);
+            }
+        } else {
+            /* Device can be found by counters_find_device() */
+            spin_lock(&counters_idr_lock);
+            idr_replace(&counters_idr, dev, dev->id);
+            spin_unlock(&counters_idr_lock);
+        }
     }
 
     return rc;
 }
 EXPORT_SYMBOL(counters_register_device);
 
+/**
+ * Register devices set
+ * 
+ * @param devs - devices, allocated by counters_allocate_device()
+ * @param count - devices count
+ * @return 
+ * 
+ * NOTE:
+ * On error whole set is released: already registered devices are
+ * unregistered, rest are freed and all entries are set to NULL.
+ */
+int counters_register_devices(struct counters_device **devs, unsigned int count) {
+    unsigned int i;
+    unsigned int j;
+    int rc = 0;
+    
+    for(i = 0; i < count; i++) {
+        rc = counters_register_device(devs[i]);
+        
+        if(rc) {
+            pr_alert("Unable to register device %u of %u\n", i, count);
+            
+            /* Devices aren't added, so they're still can be freed */
+            for(j = i; j < count; j++) {
+                counters_free_device(devs[j]);
+                devs[j] = NULL;
+            }
+            
+            counters_unregister_devices(devs, i);
+            
+            for(j = 0; j < i; j++) {
+                devs[j] = NULL;
+            }
+            
+            break;
+        }
+    }
+    
+    return rc;
+}
+EXPORT_SYMBOL(counters_register_devices);
+
 /**
  * Unregister device
  * 
@@ -249,230 +763,1236 @@ EXPORT_SYMBOL(counters_register_device);
  */
 void counters_unregister_device(struct counters_device *dev) {
     pr_devel("Unregister class device: %pK\n", dev);
+    
+    /* Device can't be found by counters_find_device() */
+    spin_lock(&counters_idr_lock);
+    idr_replace(&counters_idr, NULL, dev->id);
+    spin_unlock(&counters_idr_lock);
+
+    /* No more events for the readers */
+    spin_lock(&dev->measurements_lock);
+    dev->removed = true;
+    spin_unlock(&dev->measurements_lock);
+    
+    wake_up_interruptible(&dev->events_wait);
 
     /* Remove attribute name for this device */
     device_remove_file(&dev->dev, &dev_attr_name);
     
     device_del(&dev->dev);
+    
+    if(dev->dev.devt) {
+        cdev_del(&dev->cdev);
+    }
 
     counters_put_device(dev);
 }
 EXPORT_SYMBOL(counters_unregister_device);
 
 /**
- * Count pulse event
+ * Unregister devices set
  * 
- * @param dev
+ * @param devs - registered devices, NULL entries are skipped
+ * @param count - devices count
+ * 
+ * NOTE:
+ * Devices are unregistered in the reverse order of the registration.
  */
-void counters_pulse(struct counters_device *dev) {
-    struct timeval now;
-
-    /* Current timestamp */
-    do_gettimeofday(&now);
-    
-    spin_lock(&dev->measurements_lock);
-
-    /* Total pulses */
-    dev->pulse_count++;
-
-    if(dev->last_pulse.tv_sec || dev->last_pulse.tv_usec) {
-        /* We have previous pulse timestamp. Calculate last pulse period. */
-        if(timeval_subtract(&dev->last_pulse_period, &now, &dev->last_pulse)) {
-            /* Last timestamp less than previous (i.e. overflow detected) */
-            /* @TODO: Fix time overflow */
-            dev->last_pulse_period.tv_sec = 0;
-            dev->last_pulse_period.tv_usec = 0;
-        }
-        
-        if(dev->average_pulse_period.tv_sec || dev->average_pulse_period.tv_usec) {
-            /* Not first measurement, can calculate average period value */
-            dev->average_pulse_period.tv_sec += dev->last_pulse_period.tv_sec;
-            dev->average_pulse_period.tv_usec += dev->last_pulse_period.tv_usec;
-            
-            if(dev->average_pulse_period.tv_usec >= USEC_VALUE) {
-                dev->average_pulse_period.tv_sec += dev->average_pulse_period.tv_usec / USEC_VALUE;
-                
-                dev->average_pulse_period.tv_usec %= USEC_VALUE;
-            }
-            
-            /* Divide average value by 2 */
-            dev->average_pulse_period.tv_usec >>= 1;
-            if(dev->average_pulse_period.tv_sec & 1) {
-                dev->average_pulse_period.tv_usec += USEC_VALUE / 2;
-            }
-            dev->average_pulse_period.tv_sec >>= 1;
-
-            if(dev->average_pulse_period.tv_usec >= USEC_VALUE) {
-                dev->average_pulse_period.tv_sec += dev->average_pulse_period.tv_usec / USEC_VALUE;
-                
-                dev->average_pulse_period.tv_usec %= USEC_VALUE;
-            }
-        } else {
-            /* First measurement: can't calculate average period now */
-            memcpy(&dev->average_pulse_period, &dev->last_pulse_period, sizeof(dev->average_pulse_period));
+void counters_unregister_devices(struct counters_device **devs, unsigned int count) {
+    while(count--) {
+        if(devs[count]) {
+            counters_unregister_device(devs[count]);
         }
     }
-
-    /* Current timestamp */
-    memcpy(&dev->last_pulse, &now, sizeof(dev->last_pulse));
-    
-    spin_unlock(&dev->measurements_lock);
 }
-EXPORT_SYMBOL(counters_pulse);
+EXPORT_SYMBOL(counters_unregister_devices);
 
 /**
- * Free resources, allocated by  counters_allocate_device()
+ * Find registered device by the counter number
  * 
- * @param device
+ * @param id - N at the counterN
+ * @return device with incremented usage counter (release it by
+ *         counters_put_device()) or NULL
  */
-static void counters_device_release(struct device *device) {
-    struct counters_device *cdev = to_counters_device(device);
-    void *pvt;
-
-    if(cdev->shutdown) {
-        /* Execute driver's shutdown routine */
-        (*cdev->shutdown)(cdev);
-    }
+struct counters_device *counters_find_device(unsigned int id) {
+    struct counters_device *dev;
     
-    pvt = dev_get_drvdata(&cdev->dev);
-
-    if(pvt) {
-        pr_devel("Deallocate driver's private data: %pK\n", pvt);
-        
-        kfree(pvt);
+    if(id > INT_MAX) {
+        return NULL;
     }
     
-    pr_devel("Deallocate class data: %pK\n", cdev);
+    spin_lock(&counters_idr_lock);
     
-    /* Release string resource */
-    kfree_const(cdev->name);
+    dev = counters_get_device(idr_find(&counters_idr, id));
     
-    /* Release counters_device structure */
-    kfree(cdev);
-
-    /* Module usage count incremented by counters_allocate_device(), now we
-     * can decrement it. */
-    module_put(THIS_MODULE);
-}
-
-static ssize_t name_show(struct device *device, 
-                         struct device_attribute *attr, 
-                         char *buf) {
-    struct counters_device *cdev = to_counters_device(device);
+    spin_unlock(&counters_idr_lock);
     
-    return scnprintf(buf, PAGE_SIZE, "%s", cdev->name);
+    return dev;
 }
+EXPORT_SYMBOL(counters_find_device);
 
 /**
- * Simulate pulse
+ * Retrieve clock id by it's name
  * 
- * @param device
- * @param attr
- * @param buf
- * @param size
- * @return 
+ * @param name - "monotonic", "monotonic_raw", "boottime" or "tai"
+ * @return clock id or -EINVAL if clock name is unknown
  */
-static ssize_t pulse_store(struct device *device, 
-                           struct device_attribute *attr, 
-                           const char *buf, 
-                           size_t size) {
-    counters_pulse(to_counters_device(device));
-
-    return size;
+int counters_clock_id(const char *name) {
+    int i;
+    
+    for(i = 0; i < ARRAY_SIZE(counters_clocks); i++) {
+        if(sysfs_streq(name, counters_clocks[i].name)) {
+            return counters_clocks[i].id;
+        }
+    }
+    
+    return -EINVAL;
 }
+EXPORT_SYMBOL(counters_clock_id);
 
 /**
- * Retrieve pulse count
+ * Select clock for pulse timestamps
  * 
- * @param device
- * @param attr
- * @param buf
+ * @param dev
+ * @param clock_id - CLOCK_MONOTONIC, CLOCK_MONOTONIC_RAW, CLOCK_BOOTTIME or CLOCK_TAI
  * @return 
+ * 
+ * NOTE:
+ * Timestamps from different clocks can't be compared, so timing measurements
+ * are reset when clock is changed. Pulses, queued with the previous clock's
+ * timestamps, are accounted before reset by the same critical section.
  */
-static ssize_t count_show(struct device *device, 
-                          struct device_attribute *attr, 
-                          char *buf) {
-    unsigned long value;
-    unsigned long flags;
-    struct counters_device *dev = to_counters_device(device);
-
-    spin_lock_irqsave(&dev->measurements_lock, flags);
+int counters_set_clock(struct counters_device *dev, clockid_t clock_id) {
+    switch(clock_id) {
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+        case CLOCK_BOOTTIME:
+        case CLOCK_TAI:
+            break;
+        default:
+            return -EINVAL;
+    }
     
-    value = dev->pulse_count;
+    spin_lock(&dev->measurements_lock);
+    write_seqcount_begin(&dev->timing_seq);
     
-    if(clear_count_when_reading) {
-        /* Requested clear count after it readed */
-        dev->pulse_count = 0;
+    if(dev->clock_id != clock_id) {
+        /* Queued timestamps are taken by the previous clock */
+        counters_flush_queue(dev);
+        
+        dev->clock_id = clock_id;
+        dev->last_pulse = 0;
+        dev->window_tail = dev->window_head;
+        memset(dev->rates, 0, sizeof(dev->rates));
+        memset(dev->edge_timestamps, 0, sizeof(dev->edge_timestamps));
     }
     
-    spin_unlock_irqrestore(&dev->measurements_lock, flags);
+    write_seqcount_end(&dev->timing_seq);
+    spin_unlock(&dev->measurements_lock);
+    
+    if(wq_has_sleeper(&dev->events_wait)) {
+        wake_up_interruptible(&dev->events_wait);
+    }
     
-    return scnprintf(buf, PAGE_SIZE, "%lu", value);
+    return 0;
 }
+EXPORT_SYMBOL(counters_set_clock);
 
 /**
- * Overwrite pulse count value
+ * Enable, resize or disable shared memory ring of the pulse timestamps
  * 
- * @param device
- * @param attr
- * @param buf
- * @param size
+ * @param dev
+ * @param size - ring size (records, rounded up to power of 2) or 0 to disable ring
  * @return 
+ * 
+ * NOTE:
+ * Existing mappings keep previous ring until unmapped.
  */
-static ssize_t count_store(struct device *device, 
-                           struct device_attribute *attr, 
-                           const char *buf, 
-                           size_t size) {
-    unsigned long value;
-    unsigned long flags;
+int counters_set_ring_size(struct counters_device *dev, unsigned int size) {
+    struct counters_ring *ring = NULL;
+    struct counters_ring *old;
     
-    if(sscanf(buf, "%lu", &value) == 1) {
-        struct counters_device *dev = to_counters_device(device);
+    if(size) {
+        if(size > (1u << 24)) {
+            return -EINVAL;
+        }
         
-        spin_lock_irqsave(&dev->measurements_lock, flags);
+        ring = kzalloc(sizeof(struct counters_ring), GFP_KERNEL);
         
-        dev->pulse_count = value;
+        if(!ring) {
+            return -ENOMEM;
+        }
         
-        spin_unlock_irqrestore(&dev->measurements_lock, flags);
+        size = roundup_pow_of_two(size);
         
-        return size;
+        /* Header page and records */
+        ring->length = PAGE_SIZE + PAGE_ALIGN(size * sizeof(u64));
+        ring->header = vmalloc_user(ring->length);
+        
+        if(!ring->header) {
+            kfree(ring);
+            
+            return -ENOMEM;
+        }
+        
+        kref_init(&ring->ref);
+        ring->records = (u64 *)((char *)ring->header + PAGE_SIZE);
+        ring->mask = size - 1;
+        ring->header->size = size;
+        ring->header->record_size = sizeof(u64);
+        ring->header->data_offset = PAGE_SIZE;
     }
-
-    return -EINVAL;
+    
+    spin_lock(&dev->measurements_lock);
+    old = dev->ring;
+    dev->ring = ring;
+    spin_unlock(&dev->measurements_lock);
+    
+    if(old) {
+        kref_put(&old->ref, counters_ring_release);
+    }
+    
+    return 0;
 }
+EXPORT_SYMBOL(counters_set_ring_size);
 
-static ssize_t last_pulse_period_show(struct device *device, 
-                                      struct device_attribute *attr, 
-                                      char *buf) {
-    struct timeval value;
+/**
+ * Select CPU for the pulses processing
+ * 
+ * @param dev
+ * @param cpu - online CPU or -1 for any CPU
+ * @return 
+ * 
+ * NOTE:
+ * Driver move it's pulse sources (i.e. IRQ affinity) by the set_cpu routine,
+ * deferred accounting work is queued on the same CPU, so per CPU statistics
+ * follow it too. Concurrent calls are serialized, so pulse sources and
+ * deferred work always use the same CPU.
+ */
+int counters_set_cpu(struct counters_device *dev, int cpu) {
+    int rc = 0;
+    
+    if(cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu)))) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&dev->cpu_lock);
+    
+    if(dev->set_cpu) {
+        rc = (*dev->set_cpu)(dev, cpu);
+    }
+    
+    if(!rc) {
+        WRITE_ONCE(dev->cpu, cpu);
+    }
+    
+    mutex_unlock(&dev->cpu_lock);
+    
+    return rc;
+}
+EXPORT_SYMBOL(counters_set_cpu);
+
+/**
+ * Select pulse start edge for the drivers, which report both edges
+ * 
+ * @param dev
+ * @param edge - COUNTERS_EDGE_RISING, COUNTERS_EDGE_FALLING or 
+ *               COUNTERS_EDGE_UNKNOWN (each edge is counted)
+ * @return 
+ * 
+ * NOTE:
+ * Only start edge is counted, pulse width is measured to the opposite edge.
+ * All edges are delivered to the events readers.
+ */
+int counters_set_pulse_edge(struct counters_device *dev, unsigned int edge) {
+    switch(edge) {
+        case COUNTERS_EDGE_UNKNOWN:
+        case COUNTERS_EDGE_RISING:
+        case COUNTERS_EDGE_FALLING:
+            break;
+        default:
+            return -EINVAL;
+    }
+    
+    spin_lock(&dev->measurements_lock);
+    write_seqcount_begin(&dev->timing_seq);
+    
+    dev->pulse_edge = edge;
+    
+    write_seqcount_end(&dev->timing_seq);
+    spin_unlock(&dev->measurements_lock);
+    
+    return 0;
+}
+EXPORT_SYMBOL(counters_set_pulse_edge);
+
+/**
+ * Advance pulse rate window to the timestamp
+ * 
+ * @param rate
+ * @param length - window length (ns)
+ * @param timestamp
+ * 
+ * NOTE:
+ * Must be called with measurements_lock held. Only expired buckets are
+ * cleared, so cost is O(1) per pulse (amortized).
+ */
+static void counters_rate_advance(struct counters_rate *rate, 
+                                  u64 length, 
+                                  u64 timestamp) {
+    u64 bucket = div_u64(length, COUNTERS_RATE_BUCKETS);
+    u64 steps;
+    
+    if(timestamp <= rate->start || timestamp - rate->start < bucket) {
+        /* Still current bucket (or timestamp is out of order) */
+        return;
+    }
+    
+    steps = div64_u64(timestamp - rate->start, bucket);
+    
+    if(steps >= COUNTERS_RATE_BUCKETS) {
+        /* All buckets expired */
+        memset(rate->buckets, 0, sizeof(rate->buckets));
+        rate->sum = 0;
+    } else {
+        unsigned int i;
+        
+        for(i = 0; i < steps; i++) {
+            rate->index = (rate->index + 1) % COUNTERS_RATE_BUCKETS;
+            rate->sum -= rate->buckets[rate->index];
+            rate->buckets[rate->index] = 0;
+        }
+    }
+    
+    rate->start += steps * bucket;
+}
+
+/**
+ * Account pulses at the all rate windows
+ * 
+ * @param dev
+ * @param timestamp - pulses timestamp (ns)
+ * @param pulses
+ * 
+ * NOTE:
+ * Must be called with measurements_lock held.
+ */
+static void counters_rate_account(struct counters_device *dev, 
+                                  u64 timestamp, 
+                                  unsigned int pulses) {
+    unsigned int i;
+    
+    for(i = 0; i < COUNTERS_RATE_WINDOWS; i++) {
+        struct counters_rate *rate = &dev->rates[i];
+        
+        counters_rate_advance(rate, counters_rate_windows[i], timestamp);
+        
+        rate->buckets[rate->index] += pulses;
+        rate->sum += pulses;
+    }
+}
+
+/**
+ * Account pulse at the measurements
+ * 
+ * @param dev
+ * @param timestamp - pulse timestamp (ns)
+ * @param edge - pulse edge (COUNTERS_EDGE_*)
+ * 
+ * NOTE:
+ * Must be called with measurements_lock held and inside timing_seq write section.
+ */
+static void counters_account_pulse(struct counters_device *dev, 
+                                   u64 timestamp, 
+                                   unsigned int edge) {
+    struct counters_reader *reader;
+    struct counters_event event;
+    
+    /* Deliver event to the readers */
+    event.seq = dev->event_seq++;
+    event.timestamp = timestamp;
+    event.edge = edge;
+    
+    list_for_each_entry(reader, &dev->readers, list) {
+        event.flags = reader->overrun ? COUNTERS_EVENT_OVERRUN : 0;
+        
+        /* Queue full: drop event and report overrun with the next one */
+        reader->overrun = !kfifo_put(&reader->events, event);
+    }
+    
+    if(edge != COUNTERS_EDGE_UNKNOWN) {
+        /* Known edge: only raw timestamp, width and space are computed by the readers */
+        u64 *edge_timestamps = dev->edge_timestamps[edge - COUNTERS_EDGE_RISING];
+        
+        edge_timestamps[1] = edge_timestamps[0];
+        edge_timestamps[0] = timestamp;
+        
+        if(dev->pulse_edge != COUNTERS_EDGE_UNKNOWN && edge != dev->pulse_edge) {
+            /* End of the pulse, not counted */
+            return;
+        }
+    }
+    
+    /* Total pulses (inside timing block, readers are protected by timing_seq) */
+    dev->pulse_count++;
+    dev->pulse_total++;
+    
+    trace_counters_pulse(dev, timestamp, edge);
+
+    if(dev->window_head != dev->window_tail) {
+        /* Period to the previous timestamp */
+        u64 previous = dev->window[(dev->window_head - 1) & (COUNTERS_WINDOW_SIZE - 1)];
+        u64 period = (timestamp > previous) ? timestamp - previous : 0;
+        
+        dev->histogram[period ? ilog2(period) : 0]++;
+    }
+
+    counters_rate_account(dev, timestamp, 1);
+    
+    /* Only append timestamp, periods are computed on demand by the readers */
+    dev->window[dev->window_head++ & (COUNTERS_WINDOW_SIZE - 1)] = timestamp;
+
+    /* Current timestamp */
+    dev->last_pulse = timestamp;
+    
+    if(dev->ring) {
+        /* Publish timestamp to the shared memory ring */
+        struct counters_ring *ring = dev->ring;
+        
+        if(ring->head - smp_load_acquire(&ring->header->tail) > ring->mask) {
+            /* Ring is full */
+            WRITE_ONCE(ring->header->overruns, ++ring->overruns);
+        } else {
+            ring->records[ring->head & ring->mask] = timestamp;
+            
+            smp_store_release(&ring->header->head, ++ring->head);
+        }
+    }
+}
+
+/**
+ * Account pulses with the same timestamp at the measurements
+ * 
+ * @param dev
+ * @param timestamp - pulses timestamp (ns)
+ * @param count - pulses count
+ * 
+ * NOTE:
+ * Must be called with measurements_lock held and inside timing_seq write section.
+ * Only the first pulse is accounted by the counters_account_pulse(), the rest
+ * have zero periods and are accounted at once, so the critical section is bounded
+ * by the window, ring and readers' queues sizes instead of the pulses count.
+ */
+static void counters_account_pulses(struct counters_device *dev, 
+                                    u64 timestamp, 
+                                    u64 count) {
+    struct counters_reader *reader;
+    struct counters_event event;
+    u64 n;
+    u64 i;
+    
+    if(!count) {
+        return;
+    }
+    
+    /* First pulse: period to the previous timestamp */
+    counters_account_pulse(dev, timestamp, COUNTERS_EDGE_UNKNOWN);
+    
+    if(!--count) {
+        return;
+    }
+    
+    /* Deliver events to the readers, which have space for them */
+    event.timestamp = timestamp;
+    event.edge = COUNTERS_EDGE_UNKNOWN;
+    
+    list_for_each_entry(reader, &dev->readers, list) {
+        n = min_t(u64, count, kfifo_avail(&reader->events));
+        
+        for(i = 0; i < n; i++) {
+            event.seq = dev->event_seq + i;
+            event.flags = reader->overrun ? COUNTERS_EVENT_OVERRUN : 0;
+            
+            reader->overrun = !kfifo_put(&reader->events, event);
+        }
+        
+        if(n < count) {
+            /* Queue full: rest events are dropped */
+            reader->overrun = true;
+        }
+    }
+    
+    dev->event_seq += count;
+    
+    /* Total pulses (inside timing block, readers are protected by timing_seq) */
+    dev->pulse_count += count;
+    dev->pulse_total += count;
+    
+    /* Zero periods */
+    dev->histogram[0] += count;
+    
+    counters_rate_account(dev, timestamp, count);
+    
+    /* Only the last timestamps are kept by the window */
+    n = min_t(u64, count, COUNTERS_WINDOW_SIZE);
+    
+    for(i = 0; i < n; i++) {
+        dev->window[dev->window_head++ & (COUNTERS_WINDOW_SIZE - 1)] = timestamp;
+    }
+    
+    if(dev->ring) {
+        /* Publish timestamps to the shared memory ring */
+        struct counters_ring *ring = dev->ring;
+        u32 used = ring->head - smp_load_acquire(&ring->header->tail);
+        
+        n = (used > ring->mask) ? 0 : min_t(u64, count, ring->mask + 1 - used);
+        
+        for(i = 0; i < n; i++) {
+            ring->records[ring->head++ & ring->mask] = timestamp;
+        }
+        
+        smp_store_release(&ring->header->head, ring->head);
+        
+        if(n < count) {
+            /* Ring is full */
+            ring->overruns += count - n;
+            
+            WRITE_ONCE(ring->header->overruns, ring->overruns);
+        }
+    }
+}
+
+/**
+ * Queue pulse for the deferred processing
+ * 
+ * @param dev
+ * @param timestamp - pulse timestamp (ns), taken by counters_timestamp()
+ * @param edge - pulse edge (COUNTERS_EDGE_*)
+ * @return false, if queue is full and pulse will be counted without timestamp
+ * 
+ * NOTE:
+ * Lock-free, can be called from any context (i.e. from the hard IRQ handler)
+ * and by the several producers at the same time. Queued pulses are accounted
+ * by the counters_flush_pulses().
+ */
+bool counters_queue_pulse(struct counters_device *dev, 
+                          u64 timestamp, 
+                          unsigned int edge) {
+    unsigned int pos = atomic_read(&dev->queue_head);
+    struct counters_pulse_slot *slot;
+    
+    for(;;) {
+        int diff;
+        
+        slot = &dev->queue[pos & COUNTERS_QUEUE_MASK];
+        diff = (int)(smp_load_acquire(&slot->seq) - pos);
+        
+        if(!diff) {
+            /* Slot is free, try to reserve it */
+            unsigned int prev = atomic_cmpxchg(&dev->queue_head, pos, pos + 1);
+            
+            if(prev == pos) {
+                break;
+            }
+            
+            pos = prev;
+        } else if(diff < 0) {
+            /* Queue is full, consumer will count this pulse without timestamp */
+            atomic_inc(&dev->queue_lost);
+            
+            return false;
+        } else {
+            /* Slot reserved by the other producer */
+            pos = atomic_read(&dev->queue_head);
+        }
+    }
+    
+    slot->timestamp = timestamp;
+    slot->edge = edge;
+    
+    /* Publish slot to the consumer */
+    smp_store_release(&slot->seq, pos + 1);
+    
+    return true;
+}
+EXPORT_SYMBOL(counters_queue_pulse);
+
+/**
+ * Account all queued pulses inside the caller's critical section
+ * 
+ * @param dev
+ * 
+ * NOTE:
+ * Must be called with measurements_lock held and inside timing_seq write section.
+ * Readers must be woken up by the caller.
+ */
+static void counters_flush_queue(struct counters_device *dev) {
+    struct counters_pulse_slot *slot;
+    unsigned int queue_tail;
+    unsigned int lost;
+    u64 now = 0;
+    
+    queue_tail = dev->queue_tail;
+    
+    if(static_branch_unlikely(&counters_stats_key)) {
+        /* Handler to the accounting latency */
+        now = counters_timestamp(dev);
+    }
+    
+    for(;;) {
+        slot = &dev->queue[dev->queue_tail & COUNTERS_QUEUE_MASK];
+        
+        if(smp_load_acquire(&slot->seq) != dev->queue_tail + 1) {
+            /* No more published pulses */
+            break;
+        }
+        
+        counters_account_pulse(dev, slot->timestamp, slot->edge);
+        
+        if(now) {
+            counters_stats_record(dev, 
+                                  COUNTERS_STATS_DEFER, 
+                                  (now > slot->timestamp) ? now - slot->timestamp : 0);
+        }
+        
+        /* Return slot to the producers */
+        smp_store_release(&slot->seq, dev->queue_tail + COUNTERS_QUEUE_SIZE);
+        
+        dev->queue_tail++;
+    }
+    
+    lost = atomic_xchg(&dev->queue_lost, 0);
+    
+    if(lost) {
+        struct counters_reader *reader;
+        
+        /* Pulses without timestamps: counted only, readers see the gap */
+        dev->pulse_count += lost;
+        dev->pulse_total += lost;
+        
+        dev->event_seq += lost;
+        
+        list_for_each_entry(reader, &dev->readers, list) {
+            reader->overrun = true;
+        }
+        
+        /* Window periods must not span pulses without timestamps */
+        dev->window_tail = dev->window_head;
+        
+        /* Pulse rate: lost pulses are accounted at the current time */
+        counters_rate_account(dev, counters_timestamp(dev), lost);
+        
+        dev->flush_lost += lost;
+    }
+    
+    if(lost || queue_tail != dev->queue_tail) {
+        /* Batch size is flush_pulses / flush_batches */
+        dev->flush_batches++;
+        dev->flush_pulses += dev->queue_tail - queue_tail;
+    }
+}
+
+/**
+ * Account all queued pulses
+ * 
+ * @param dev
+ * 
+ * NOTE:
+ * Deferred part of the pulse processing, must be called from the process
+ * context (i.e. from the IRQ thread).
+ */
+void counters_flush_pulses(struct counters_device *dev) {
+    spin_lock(&dev->measurements_lock);
+    write_seqcount_begin(&dev->timing_seq);
+    
+    counters_flush_queue(dev);
+    
+    write_seqcount_end(&dev->timing_seq);
+    spin_unlock(&dev->measurements_lock);
+    
+    if(wq_has_sleeper(&dev->events_wait)) {
+        wake_up_interruptible(&dev->events_wait);
+    }
+}
+EXPORT_SYMBOL(counters_flush_pulses);
+
+/**
+ * Record handler statistics sample
+ * 
+ * @param dev
+ * @param kind - COUNTERS_STATS_*
+ * @param value - sample (ns)
+ * 
+ * NOTE:
+ * Can be called from any context. Drivers must use counters_stats_isr() and
+ * counters_stats_latency(), which cost nothing while collection is disabled.
+ */
+void counters_stats_record(struct counters_device *dev, 
+                           unsigned int kind, 
+                           u64 value) {
+    struct counters_stats *stats;
+    struct counters_stats_histogram *histogram;
     unsigned long flags;
     
-    struct counters_device *dev = to_counters_device(device);
+    /* Hard IRQ handler may record on the same CPU */
+    local_irq_save(flags);
+    
+    stats = this_cpu_ptr(dev->stats);
+    histogram = &stats->kinds[kind];
+    
+    u64_stats_update_begin(&stats->syncp);
+    
+    if(!histogram->count || value < histogram->min) {
+        histogram->min = value;
+    }
+    
+    if(value > histogram->max) {
+        histogram->max = value;
+    }
+    
+    histogram->count++;
+    histogram->buckets[value ? min_t(unsigned int, ilog2(value), COUNTERS_STATS_BUCKETS - 1) : 0]++;
+    
+    u64_stats_update_end(&stats->syncp);
+    
+    local_irq_restore(flags);
+}
+EXPORT_SYMBOL(counters_stats_record);
+
+/**
+ * Account queued pulses by the work queue
+ * 
+ * @param dev
+ * 
+ * NOTE:
+ * Can be called from any context, for producers without own deferred context
+ * (i.e. timers). Several calls before the work is executed are accounted by
+ * the one batch.
+ */
+void counters_schedule_flush(struct counters_device *dev) {
+    int cpu = READ_ONCE(dev->cpu);
+    
+    if(cpu >= 0 && cpu_online(cpu)) {
+        /* Keep pulses processing at the selected CPU */
+        queue_work_on(cpu, system_wq, &dev->flush_work);
+    } else {
+        schedule_work(&dev->flush_work);
+    }
+}
+EXPORT_SYMBOL(counters_schedule_flush);
+
+/**
+ * Count edge, rejected by the driver's filter (i.e. contact bounce)
+ * 
+ * @param dev
+ * 
+ * NOTE:
+ * Can be called from any context.
+ */
+void counters_reject_pulse(struct counters_device *dev) {
+    u64 rejected = atomic64_inc_return(&dev->rejected);
+    
+    trace_counters_reject(dev, rejected);
+}
+EXPORT_SYMBOL(counters_reject_pulse);
+
+/**
+ * Count pulse event
+ * 
+ * @param dev
+ * @param timestamp - pulse timestamp (ns), taken by counters_timestamp()
+ * @param edge - pulse edge (COUNTERS_EDGE_*)
+ * 
+ * NOTE:
+ * Can be called from any context, pulse is accounted by the work queue.
+ */
+void counters_pulse_event(struct counters_device *dev, 
+                          u64 timestamp, 
+                          unsigned int edge) {
+    counters_queue_pulse(dev, timestamp, edge);
+    
+    counters_schedule_flush(dev);
+}
+EXPORT_SYMBOL(counters_pulse_event);
+
+/**
+ * Deferred pulses processing for the counters_pulse_event()
+ * 
+ * @param work
+ */
+static void counters_flush_work(struct work_struct *work) {
+    counters_flush_pulses(container_of(work, struct counters_device, flush_work));
+}
+
+/**
+ * Free resources, allocated by  counters_allocate_device()
+ * 
+ * @param device
+ */
+static void counters_device_release(struct device *device) {
+    struct counters_device *cdev = to_counters_device(device);
+
+    if(cdev->shutdown) {
+        /* Execute driver's shutdown routine */
+        (*cdev->shutdown)(cdev);
+    }
+    
+    /* Hardware is released, no more pulses */
+    cancel_work_sync(&cdev->flush_work);
+    
+    if(cdev->ring) {
+        /* Release shared memory ring (if it's not mapped now) */
+        kref_put(&cdev->ring->ref, counters_ring_release);
+    }
+    
+    pr_devel("Deallocate class data: %pK\n", cdev);
+    
+    /* Release handler statistics */
+    free_percpu(cdev->stats);
+    
+    /* Counter number can be reused */
+    spin_lock(&counters_idr_lock);
+    idr_remove(&counters_idr, cdev->id);
+    spin_unlock(&counters_idr_lock);
+    
+    /* Release name and driver's private data */
+    kfree(cdev->name);
+    
+    /* Release counters_device structure */
+    kmem_cache_free(counters_device_cache, cdev);
+
+    /* Module usage count incremented by counters_allocate_device(), now we
+     * can decrement it. */
+    module_put(THIS_MODULE);
+}
+
+static ssize_t name_show(struct device *device, 
+                         struct device_attribute *attr, 
+                         char *buf) {
+    struct counters_device *cdev = to_counters_device(device);
+    
+    return scnprintf(buf, PAGE_SIZE, "%s", cdev->name);
+}
+
+static ssize_t ring_size_show(struct device *device, 
+                              struct device_attribute *attr, 
+                              char *buf) {
+    struct counters_device *cdev = to_counters_device(device);
+    unsigned int size;
+    
+    spin_lock(&cdev->measurements_lock);
+    size = cdev->ring ? cdev->ring->mask + 1 : 0;
+    spin_unlock(&cdev->measurements_lock);
+    
+    return scnprintf(buf, PAGE_SIZE, "%u", size);
+}
+
+/**
+ * Setup shared memory ring of the pulse timestamps
+ * 
+ * @param device
+ * @param attr
+ * @param buf - ring size (records) or 0 to disable ring
+ * @param size
+ * @return 
+ */
+static ssize_t ring_size_store(struct device *device, 
+                               struct device_attribute *attr, 
+                               const char *buf, 
+                               size_t size) {
+    unsigned int value;
+    int rc = kstrtouint(buf, 0, &value);
+    
+    if(!rc) {
+        rc = counters_set_ring_size(to_counters_device(device), value);
+    }
+    
+    return rc ? rc : size;
+}
+
+static ssize_t cpu_show(struct device *device, 
+                        struct device_attribute *attr, 
+                        char *buf) {
+    return scnprintf(buf, PAGE_SIZE, "%d", READ_ONCE(to_counters_device(device)->cpu));
+}
+
+/**
+ * Select CPU for the pulses processing
+ * 
+ * @param device
+ * @param attr
+ * @param buf - online CPU number or -1 for any CPU
+ * @param size
+ * @return 
+ */
+static ssize_t cpu_store(struct device *device, 
+                         struct device_attribute *attr, 
+                         const char *buf, 
+                         size_t size) {
+    int cpu;
+    int rc = kstrtoint(buf, 0, &cpu);
+    
+    if(!rc) {
+        rc = counters_set_cpu(to_counters_device(device), cpu);
+    }
+    
+    return rc ? rc : size;
+}
+
+static ssize_t clock_show(struct device *device, 
+                          struct device_attribute *attr, 
+                          char *buf) {
+    struct counters_device *cdev = to_counters_device(device);
+    int i;
+    
+    for(i = 0; i < ARRAY_SIZE(counters_clocks); i++) {
+        if(counters_clocks[i].id == cdev->clock_id) {
+            return scnprintf(buf, PAGE_SIZE, "%s", counters_clocks[i].name);
+        }
+    }
+    
+    return -EINVAL;
+}
+
+/**
+ * Select clock for pulse timestamps
+ * 
+ * @param device
+ * @param attr
+ * @param buf - "monotonic", "monotonic_raw", "boottime" or "tai"
+ * @param size
+ * @return 
+ */
+static ssize_t clock_store(struct device *device, 
+                           struct device_attribute *attr, 
+                           const char *buf, 
+                           size_t size) {
+    int clock_id = counters_clock_id(buf);
+    int rc;
+    
+    if(clock_id < 0) {
+        return clock_id;
+    }
+    
+    rc = counters_set_clock(to_counters_device(device), clock_id);
+    
+    return rc ? rc : size;
+}
+
+/**
+ * Account batch of the injected pulses
+ * 
+ * @param dev
+ * @param records - pulses with the timestamps or NULL for the current timestamp
+ * @param n - records count
+ * @param count - pulses count, if records is NULL
+ * 
+ * NOTE:
+ * Whole batch is accounted by the one critical section, the same way as
+ * pulses from the driver. Each record is accounted by the
+ * counters_account_pulses(), so the critical section doesn't grow with the
+ * pulses count. Pulses count must be checked by the caller.
+ */
+static void counters_inject_pulses(struct counters_device *dev, 
+                                   const struct counters_pulse_record *records, 
+                                   size_t n, 
+                                   u64 count) {
+    size_t i;
+    
+    spin_lock(&dev->measurements_lock);
+    write_seqcount_begin(&dev->timing_seq);
+    
+    /* Pulses, which are queued by the driver, are accounted before batch */
+    counters_flush_queue(dev);
+    
+    if(records) {
+        for(i = 0; i < n; i++) {
+            counters_account_pulses(dev, records[i].timestamp, records[i].count);
+        }
+    } else {
+        counters_account_pulses(dev, counters_timestamp(dev), count);
+    }
+    
+    write_seqcount_end(&dev->timing_seq);
+    spin_unlock(&dev->measurements_lock);
+    
+    if(wq_has_sleeper(&dev->events_wait)) {
+        wake_up_interruptible(&dev->events_wait);
+    }
+}
+
+/**
+ * Simulate N pulses (N is written, up to COUNTERS_BATCH_MAX)
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @param size
+ * @return 
+ */
+static ssize_t pulse_store(struct device *device, 
+                           struct device_attribute *attr, 
+                           const char *buf, 
+                           size_t size) {
+    unsigned int count;
+    int rc = kstrtouint(buf, 0, &count);
+    
+    if(rc) {
+        return rc;
+    }
+    
+    if(count > COUNTERS_BATCH_MAX) {
+        return -EINVAL;
+    }
+    
+    /* Simulated pulses are accounted immediately */
+    counters_inject_pulses(to_counters_device(device), NULL, 0, count);
+    
+    return size;
+}
+
+/**
+ * Inject packed struct counters_pulse_record array (i.e. recorded trace)
+ * 
+ * @param file
+ * @param kobj
+ * @param attr
+ * @param buf
+ * @param pos
+ * @param count
+ * @return 
+ * 
+ * NOTE:
+ * Each call is accounted as the one batch, it must contain whole records
+ * and up to COUNTERS_BATCH_MAX pulses. Sysfs split writes to the page sized
+ * calls with the growing pos, which is ignored: longer write is accounted as
+ * several batches and the attribute can be written as a stream.
+ */
+static ssize_t pulse_batch_write(struct file *file, 
+                                 struct kobject *kobj, 
+                                 struct bin_attribute *attr, 
+                                 char *buf, 
+                                 loff_t pos, 
+                                 size_t count) {
+    const struct counters_pulse_record *records = (const void *)buf;
+    size_t n = count / sizeof(struct counters_pulse_record);
+    u64 pulses = 0;
+    size_t i;
+    
+    if(count % sizeof(struct counters_pulse_record)) {
+        return -EINVAL;
+    }
+    
+    for(i = 0; i < n; i++) {
+        if(records[i].count > COUNTERS_BATCH_MAX - pulses) {
+            return -EINVAL;
+        }
+        
+        pulses += records[i].count;
+    }
+    
+    counters_inject_pulses(to_counters_device(kobj_to_dev(kobj)), records, n, 0);
+    
+    return count;
+}
+
+/**
+ * Retrieve pulse count
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @return 
+ */
+static ssize_t count_show(struct device *device, 
+                          struct device_attribute *attr, 
+                          char *buf) {
+    u64 value;
+    unsigned int seq;
+    struct counters_device *dev = to_counters_device(device);
+
+    if(clear_count_when_reading) {
+        /* Requested clear count after it readed */
+        spin_lock(&dev->measurements_lock);
+        write_seqcount_begin(&dev->timing_seq);
+        
+        value = dev->pulse_count;
+        dev->pulse_count = 0;
+        
+        write_seqcount_end(&dev->timing_seq);
+        spin_unlock(&dev->measurements_lock);
+        
+        trace_counters_reset(dev, value, 0);
+    } else {
+        /* 64-bit value can't be read atomically on 32-bit platforms */
+        do {
+            seq = read_seqcount_begin(&dev->timing_seq);
+            
+            value = dev->pulse_count;
+        } while(read_seqcount_retry(&dev->timing_seq, seq));
+    }
+    
+    return scnprintf(buf, PAGE_SIZE, "%llu", (unsigned long long)value);
+}
+
+/**
+ * Overwrite pulse count value
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @param size
+ * @return 
+ */
+static ssize_t count_store(struct device *device, 
+                           struct device_attribute *attr, 
+                           const char *buf, 
+                           size_t size) {
+    u64 value;
+    
+    if(!kstrtou64(buf, 0, &value)) {
+        struct counters_device *dev = to_counters_device(device);
+        u64 count;
+        
+        spin_lock(&dev->measurements_lock);
+        write_seqcount_begin(&dev->timing_seq);
+        
+        count = dev->pulse_count;
+        dev->pulse_count = value;
+        
+        write_seqcount_end(&dev->timing_seq);
+        spin_unlock(&dev->measurements_lock);
+        
+        trace_counters_reset(dev, count, value);
+        
+        return size;
+    }
+
+    return -EINVAL;
+}
+
+/**
+ * Copy valid timestamps of the window, oldest first
+ * 
+ * @param dev
+ * @param timestamps - array of COUNTERS_WINDOW_SIZE records
+ * @return copied timestamps
+ * 
+ * NOTE:
+ * Must be called inside timing_seq read section (or with measurements_lock held).
+ */
+static unsigned int counters_window_copy(const struct counters_device *dev, 
+                                         u64 *timestamps) {
+    unsigned int head = READ_ONCE(dev->window_head);
+    unsigned int n = min_t(unsigned int, 
+                           head - READ_ONCE(dev->window_tail), 
+                           COUNTERS_WINDOW_SIZE);
+    unsigned int i;
+    
+    for(i = 0; i < n; i++) {
+        timestamps[i] = dev->window[(head - n + i) & (COUNTERS_WINDOW_SIZE - 1)];
+    }
+    
+    return n;
+}
+
+/**
+ * Compute period statistics from the timestamps
+ * 
+ * @param timestamps - timestamps, oldest first
+ * @param n - timestamps count
+ * @param stats
+ * 
+ * NOTE:
+ * Less than two timestamps give zero periods.
+ */
+static void counters_window_stats(const u64 *timestamps, 
+                                  unsigned int n, 
+                                  struct counters_period_stats *stats) {
+    unsigned int i;
+    
+    memset(stats, 0, sizeof(*stats));
+    
+    if(n < 2) {
+        return;
+    }
+    
+    stats->min = U64_MAX;
+    
+    for(i = 1; i < n; i++) {
+        u64 period = (timestamps[i] > timestamps[i - 1]) ? 
+            timestamps[i] - timestamps[i - 1] : 0;
+        
+        stats->min = min(stats->min, period);
+        stats->max = max(stats->max, period);
+        stats->last = period;
+    }
+    
+    /* True mean: sum of the periods is the window time span */
+    stats->average = (timestamps[n - 1] > timestamps[0]) ? 
+        div_u64(timestamps[n - 1] - timestamps[0], n - 1) : 0;
+}
 
-    spin_lock_irqsave(&dev->measurements_lock, flags);
+/**
+ * Consistent period statistics of the device
+ * 
+ * @param dev
+ * @param stats
+ */
+static void counters_period_stats(struct counters_device *dev, 
+                                  struct counters_period_stats *stats) {
+    u64 timestamps[COUNTERS_WINDOW_SIZE];
+    unsigned int seq;
+    unsigned int n;
     
-    memcpy(&value, &dev->last_pulse_period, sizeof(value));
+    do {
+        seq = read_seqcount_begin(&dev->timing_seq);
+        
+        n = counters_window_copy(dev, timestamps);
+    } while(read_seqcount_retry(&dev->timing_seq, seq));
     
-    spin_unlock_irqrestore(&dev->measurements_lock, flags);
+    counters_window_stats(timestamps, n, stats);
+}
+
+/**
+ * Restart statistics window, last timestamp is kept for the next period
+ * 
+ * @param dev
+ * 
+ * NOTE:
+ * Must be called with measurements_lock held and inside timing_seq write section.
+ */
+static void counters_window_restart(struct counters_device *dev) {
+    if(dev->window_head != dev->window_tail) {
+        dev->window_tail = dev->window_head - 1;
+    }
+}
+
+static ssize_t last_pulse_period_show(struct device *device, 
+                                      struct device_attribute *attr, 
+                                      char *buf) {
+    struct counters_period_stats stats;
+
+    counters_period_stats(to_counters_device(device), &stats);
     
-    return (value.tv_sec || value.tv_usec) ?
-        scnprintf(buf, PAGE_SIZE, "%lu%lu", value.tv_sec, value.tv_usec) :
-        scnprintf(buf, PAGE_SIZE, "%u", 0);
+    /* Period value in us */
+    return scnprintf(buf, PAGE_SIZE, "%llu", 
+                     (unsigned long long)div_u64(stats.last, NSEC_PER_USEC));
 }
 
 static ssize_t last_pulse_period_store(struct device *device, 
                                        struct device_attribute *attr, 
                                        const char *buf, 
                                        size_t size) {
-    unsigned long flags;
     struct counters_device *dev = to_counters_device(device);
 
-    spin_lock_irqsave(&dev->measurements_lock, flags);
+    spin_lock(&dev->measurements_lock);
+    write_seqcount_begin(&dev->timing_seq);
 
-    dev->last_pulse_period.tv_sec = 0;
-    dev->last_pulse_period.tv_usec = 0;
+    counters_window_restart(dev);
 
-    spin_unlock_irqrestore(&dev->measurements_lock, flags);
+    write_seqcount_end(&dev->timing_seq);
+    spin_unlock(&dev->measurements_lock);
 
     return size;
 }
@@ -480,39 +2000,503 @@ static ssize_t last_pulse_period_store(struct device *device,
 static ssize_t average_pulse_period_show(struct device *device, 
                                          struct device_attribute *attr, 
                                          char *buf) {
-    struct timeval value;
-    unsigned long flags;
+    struct counters_period_stats stats;
+
+    counters_period_stats(to_counters_device(device), &stats);
+    
+    /* Period value in us */
+    return scnprintf(buf, PAGE_SIZE, "%llu", 
+                     (unsigned long long)div_u64(stats.average, NSEC_PER_USEC));
+}
+
+static ssize_t average_pulse_period_store(struct device *device, 
+                                          struct device_attribute *attr, 
+                                          const char *buf, 
+                                          size_t size) {
+    /* All statistics are computed from the one window */
+    return last_pulse_period_store(device, attr, buf, size);
+}
+
+static ssize_t min_pulse_period_show(struct device *device, 
+                                     struct device_attribute *attr, 
+                                     char *buf) {
+    struct counters_period_stats stats;
+
+    counters_period_stats(to_counters_device(device), &stats);
+    
+    /* Period value in us */
+    return scnprintf(buf, PAGE_SIZE, "%llu", 
+                     (unsigned long long)div_u64(stats.min, NSEC_PER_USEC));
+}
+
+static ssize_t max_pulse_period_show(struct device *device, 
+                                     struct device_attribute *attr, 
+                                     char *buf) {
+    struct counters_period_stats stats;
+
+    counters_period_stats(to_counters_device(device), &stats);
+    
+    /* Period value in us */
+    return scnprintf(buf, PAGE_SIZE, "%llu", 
+                     (unsigned long long)div_u64(stats.max, NSEC_PER_USEC));
+}
+
+/**
+ * Pulse rate (Hz) over the 1s, 10s, 60s and 15m windows, like the loadavg
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @return 
+ * 
+ * NOTE:
+ * Rate is pulses in the window divided by the time it cover (current bucket
+ * is partial). Only the running sums are read, history isn't walked.
+ */
+static ssize_t rate_show(struct device *device, 
+                         struct device_attribute *attr, 
+                         char *buf) {
+    struct counters_device *dev = to_counters_device(device);
+    u64 sum[COUNTERS_RATE_WINDOWS];
+    u64 span[COUNTERS_RATE_WINDOWS];
+    ssize_t length = 0;
+    unsigned int i;
+    u64 now;
+    
+    spin_lock(&dev->measurements_lock);
+    
+    now = counters_timestamp(dev);
+    
+    for(i = 0; i < COUNTERS_RATE_WINDOWS; i++) {
+        struct counters_rate *rate = &dev->rates[i];
+        u64 bucket = div_u64(counters_rate_windows[i], COUNTERS_RATE_BUCKETS);
+        
+        counters_rate_advance(rate, counters_rate_windows[i], now);
+        
+        sum[i] = rate->sum;
+        span[i] = counters_rate_windows[i] - bucket + 
+            ((now > rate->start) ? now - rate->start : 0);
+    }
+    
+    spin_unlock(&dev->measurements_lock);
+    
+    for(i = 0; i < COUNTERS_RATE_WINDOWS; i++) {
+        /* Rate in mHz: pulses * 10^9 / span (us) */
+        u64 mhz = div64_u64(sum[i] * NSEC_PER_SEC, 
+                            max_t(u64, div_u64(span[i], NSEC_PER_USEC), 1));
+        u32 fraction;
+        u64 hz = div_u64_rem(mhz, 1000, &fraction);
+        
+        length += scnprintf(buf + length, PAGE_SIZE - length, "%s%llu.%03u", 
+                            i ? " " : "", (unsigned long long)hz, fraction);
+    }
+    
+    return length;
+}
+
+/**
+ * Last pulse width and space, computed from the raw edges timestamps
+ * 
+ * @param dev
+ * @param width - active level duration (ns) or 0
+ * @param space - inactive level duration (ns) or 0
+ */
+static void counters_width_stats(struct counters_device *dev, 
+                                 u64 *width, 
+                                 u64 *space) {
+    u64 start[2];
+    u64 end[2];
+    unsigned int seq;
+    
+    do {
+        unsigned int pulse_edge;
+        
+        seq = read_seqcount_begin(&dev->timing_seq);
+        
+        /* Without selected edge pulse is the high level */
+        pulse_edge = (dev->pulse_edge == COUNTERS_EDGE_FALLING) ? 
+            COUNTERS_EDGE_FALLING : COUNTERS_EDGE_RISING;
+        
+        memcpy(start, 
+               dev->edge_timestamps[pulse_edge - COUNTERS_EDGE_RISING], 
+               sizeof(start));
+        memcpy(end, 
+               dev->edge_timestamps[COUNTERS_EDGE_FALLING - pulse_edge], 
+               sizeof(end));
+    } while(read_seqcount_retry(&dev->timing_seq, seq));
+    
+    *width = 0;
+    *space = 0;
+    
+    if(end[0] > start[0]) {
+        /* Line is inactive: last pulse is complete */
+        *width = start[0] ? end[0] - start[0] : 0;
+        *space = (end[1] && end[1] < start[0]) ? start[0] - end[1] : 0;
+    } else if(start[0] > end[0]) {
+        /* Line is active: last space is complete */
+        *space = end[0] ? start[0] - end[0] : 0;
+        *width = (start[1] && start[1] < end[0]) ? end[0] - start[1] : 0;
+    }
+}
+
+static ssize_t pulse_width_show(struct device *device, 
+                                struct device_attribute *attr, 
+                                char *buf) {
+    u64 width;
+    u64 space;
+    
+    counters_width_stats(to_counters_device(device), &width, &space);
+    
+    /* Width value in us */
+    return scnprintf(buf, PAGE_SIZE, "%llu", 
+                     (unsigned long long)div_u64(width, NSEC_PER_USEC));
+}
+
+static ssize_t pulse_space_show(struct device *device, 
+                                struct device_attribute *attr, 
+                                char *buf) {
+    u64 width;
+    u64 space;
+    
+    counters_width_stats(to_counters_device(device), &width, &space);
+    
+    /* Space value in us */
+    return scnprintf(buf, PAGE_SIZE, "%llu", 
+                     (unsigned long long)div_u64(space, NSEC_PER_USEC));
+}
+
+/**
+ * Duty cycle (%) of the last pulse
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @return 
+ */
+static ssize_t duty_cycle_show(struct device *device, 
+                               struct device_attribute *attr, 
+                               char *buf) {
+    u64 width;
+    u64 space;
+    u32 permille = 0;
+    
+    counters_width_stats(to_counters_device(device), &width, &space);
+    
+    if(width && space) {
+        permille = (u32)div64_u64(width * 1000, width + space);
+    }
+    
+    return scnprintf(buf, PAGE_SIZE, "%u.%u", permille / 10, permille % 10);
+}
+
+/**
+ * Retrieve count of the edges, rejected by the driver's filter
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @return 
+ */
+static ssize_t rejected_show(struct device *device, 
+                             struct device_attribute *attr, 
+                             char *buf) {
+    struct counters_device *dev = to_counters_device(device);
+    
+    return scnprintf(buf, PAGE_SIZE, "%llu", 
+                     (unsigned long long)atomic64_read(&dev->rejected));
+}
+
+/**
+ * Read pulse periods histogram (array of u64 bucket counters)
+ * 
+ * @param file
+ * @param kobj
+ * @param attr
+ * @param buf
+ * @param pos
+ * @param count
+ * @return 
+ * 
+ * NOTE:
+ * Buckets are copied by the timing block snapshot, consistent with the
+ * pulses counted at the same time.
+ */
+static ssize_t histogram_read(struct file *file, 
+                              struct kobject *kobj, 
+                              struct bin_attribute *attr, 
+                              char *buf, 
+                              loff_t pos, 
+                              size_t count) {
+    struct counters_device *dev = to_counters_device(kobj_to_dev(kobj));
+    u64 buckets[COUNTERS_HISTOGRAM_BUCKETS];
+    unsigned int seq;
+    
+    if(pos >= sizeof(buckets)) {
+        return 0;
+    }
+    
+    count = min_t(size_t, count, sizeof(buckets) - pos);
+    
+    do {
+        seq = read_seqcount_begin(&dev->timing_seq);
+        
+        memcpy(buckets, dev->histogram, sizeof(buckets));
+    } while(read_seqcount_retry(&dev->timing_seq, seq));
+    
+    memcpy(buf, (char *)buckets + pos, count);
+    
+    return count;
+}
+
+/**
+ * Reset pulse periods histogram (any data written)
+ * 
+ * @param file
+ * @param kobj
+ * @param attr
+ * @param buf
+ * @param pos
+ * @param count
+ * @return 
+ */
+static ssize_t histogram_write(struct file *file, 
+                               struct kobject *kobj, 
+                               struct bin_attribute *attr, 
+                               char *buf, 
+                               loff_t pos, 
+                               size_t count) {
+    struct counters_device *dev = to_counters_device(kobj_to_dev(kobj));
+    
+    spin_lock(&dev->measurements_lock);
+    write_seqcount_begin(&dev->timing_seq);
+    
+    memset(dev->histogram, 0, sizeof(dev->histogram));
+    
+    write_seqcount_end(&dev->timing_seq);
+    spin_unlock(&dev->measurements_lock);
+    
+    return count;
+}
+
+/**
+ * Show handler statistics of the one kind
+ * 
+ * @param device
+ * @param buf
+ * @param kind - COUNTERS_STATS_*
+ * @return "count min max p99" (ns)
+ * 
+ * NOTE:
+ * p99 is the upper bound of the log2 bucket, limited by the max. value.
+ */
+static ssize_t counters_stats_show(struct device *device, 
+                                   char *buf, 
+                                   unsigned int kind) {
+    struct counters_device *dev = to_counters_device(device);
+    struct counters_stats_histogram total;
+    u64 target;
+    u64 p99 = 0;
+    u64 samples = 0;
+    unsigned int cpu;
+    unsigned int i;
+    
+    memset(&total, 0, sizeof(total));
+    
+    for_each_possible_cpu(cpu) {
+        const struct counters_stats *stats = per_cpu_ptr(dev->stats, cpu);
+        struct counters_stats_histogram histogram;
+        unsigned int start;
+        
+        do {
+            start = u64_stats_fetch_begin(&stats->syncp);
+            
+            histogram = stats->kinds[kind];
+        } while(u64_stats_fetch_retry(&stats->syncp, start));
+        
+        if(!histogram.count) {
+            continue;
+        }
+        
+        if(!total.count || histogram.min < total.min) {
+            total.min = histogram.min;
+        }
+        
+        total.max = max(total.max, histogram.max);
+        total.count += histogram.count;
+        
+        for(i = 0; i < COUNTERS_STATS_BUCKETS; i++) {
+            total.buckets[i] += histogram.buckets[i];
+        }
+    }
+    
+    /* Samples at the buckets, which are below p99 */
+    target = total.count - div_u64(total.count, 100);
+    
+    for(i = 0; i < COUNTERS_STATS_BUCKETS && total.count; i++) {
+        samples += total.buckets[i];
+        
+        if(samples >= target) {
+            p99 = min(total.max, (2ULL << i) - 1);
+            
+            break;
+        }
+    }
+    
+    return scnprintf(buf, PAGE_SIZE, "%llu %llu %llu %llu", 
+                     (unsigned long long)total.count, 
+                     (unsigned long long)total.min, 
+                     (unsigned long long)total.max, 
+                     (unsigned long long)p99);
+}
+
+static ssize_t isr_show(struct device *device, 
+                        struct device_attribute *attr, 
+                        char *buf) {
+    return counters_stats_show(device, buf, COUNTERS_STATS_ISR);
+}
+
+static ssize_t latency_show(struct device *device, 
+                            struct device_attribute *attr, 
+                            char *buf) {
+    return counters_stats_show(device, buf, COUNTERS_STATS_LATENCY);
+}
+
+static ssize_t defer_show(struct device *device, 
+                          struct device_attribute *attr, 
+                          char *buf) {
+    return counters_stats_show(device, buf, COUNTERS_STATS_DEFER);
+}
+
+/**
+ * Reset handler statistics of the one CPU
+ * 
+ * @param stats
+ */
+static void counters_stats_reset(struct counters_stats *stats) {
+    u64_stats_update_begin(&stats->syncp);
+    memset(stats->kinds, 0, sizeof(stats->kinds));
+    u64_stats_update_end(&stats->syncp);
+}
+
+/**
+ * Reset handler statistics of the current CPU (called by on_each_cpu())
+ * 
+ * @param info - device
+ */
+static void counters_stats_reset_cpu(void *info) {
+    struct counters_device *dev = info;
+    
+    counters_stats_reset(this_cpu_ptr(dev->stats));
+}
+
+/**
+ * Reset handler statistics (any value written)
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @param size
+ * @return 
+ * 
+ * NOTE:
+ * Each CPU reset own part with IRQ disabled, so the only writer of the
+ * per CPU sequence is the owner CPU.
+ */
+static ssize_t reset_store(struct device *device, 
+                           struct device_attribute *attr, 
+                           const char *buf, 
+                           size_t size) {
+    struct counters_device *dev = to_counters_device(device);
+    unsigned int cpu;
+    
+    get_online_cpus();
+    
+    on_each_cpu(counters_stats_reset_cpu, dev, 1);
+    
+    for_each_possible_cpu(cpu) {
+        if(!cpu_online(cpu)) {
+            /* Offline CPU don't record samples */
+            counters_stats_reset(per_cpu_ptr(dev->stats, cpu));
+        }
+    }
+    
+    put_online_cpus();
+    
+    return size;
+}
+
+/**
+ * Accounting throughput
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @return "batches pulses lost"
+ * 
+ * NOTE:
+ * Counted always, pulses per second is the difference between two reads.
+ */
+static ssize_t flush_show(struct device *device, 
+                          struct device_attribute *attr, 
+                          char *buf) {
     struct counters_device *dev = to_counters_device(device);
-
-    spin_lock_irqsave(&dev->measurements_lock, flags);
+    u64 batches;
+    u64 pulses;
+    u64 lost;
+    
+    spin_lock(&dev->measurements_lock);
     
-    memcpy(&value, &dev->average_pulse_period, sizeof(value));
+    batches = dev->flush_batches;
+    pulses = dev->flush_pulses;
+    lost = dev->flush_lost;
     
-    spin_unlock_irqrestore(&dev->measurements_lock, flags);
+    spin_unlock(&dev->measurements_lock);
     
-    return (value.tv_sec || value.tv_usec) ?
-        scnprintf(buf, PAGE_SIZE, "%lu%lu", value.tv_sec, value.tv_usec) :
-        scnprintf(buf, PAGE_SIZE, "%u", 0);
+    return scnprintf(buf, PAGE_SIZE, "%llu %llu %llu", 
+                     (unsigned long long)batches, 
+                     (unsigned long long)pulses, 
+                     (unsigned long long)lost);
 }
 
-static ssize_t average_pulse_period_store(struct device *device, 
-                                          struct device_attribute *attr, 
-                                          const char *buf, 
-                                          size_t size) {
-    unsigned long flags;
-    struct counters_device *dev = to_counters_device(device);
-
-    spin_lock_irqsave(&dev->measurements_lock, flags);
-
-    dev->average_pulse_period.tv_sec = 0;
-    dev->average_pulse_period.tv_usec = 0;
-
-    spin_unlock_irqrestore(&dev->measurements_lock, flags);
+static ssize_t collect_stats_show(struct class *class, 
+                                  struct class_attribute *attr, 
+                                  char *buf) {
+    return scnprintf(buf, PAGE_SIZE, "%d", 
+                     static_key_enabled(&counters_stats_key) ? 1 : 0);
+}
 
+/**
+ * Enable or disable handler statistics collection for all counters
+ * 
+ * @param class
+ * @param attr
+ * @param buf
+ * @param size
+ * @return 
+ * 
+ * NOTE:
+ * Disabled collection is patched out by the static key.
+ */
+static ssize_t collect_stats_store(struct class *class, 
+                                   struct class_attribute *attr, 
+                                   const char *buf, 
+                                   size_t size) {
+    bool value;
+    int rc = kstrtobool(buf, &value);
+    
+    if(rc) {
+        return rc;
+    }
+    
+    if(value) {
+        static_branch_enable(&counters_stats_key);
+    } else {
+        static_branch_disable(&counters_stats_key);
+    }
+    
     return size;
 }
 
-
 static ssize_t clear_count_when_reading_show(struct class *class, struct class_attribute *attr, char *buf)
 {
     return scnprintf(buf, PAGE_SIZE, "%d", clear_count_when_reading);
@@ -537,43 +2521,497 @@ static char *counters_devnode(struct device *dev, umode_t *mode)
 }
 
 /**
- * Calculate (*x) - (*y)
+ * Consistent pulses total of the device
+ * 
+ * @param dev
+ * @return 
+ */
+static u64 counters_pulse_total(struct counters_device *dev) {
+    unsigned int seq;
+    u64 total;
+    
+    do {
+        seq = read_seqcount_begin(&dev->timing_seq);
+        
+        total = dev->pulse_total;
+    } while(read_seqcount_retry(&dev->timing_seq, seq));
+    
+    return total;
+}
+
+/**
+ * Open pulse events stream
+ * 
+ * @param inode
+ * @param file
+ * @return 
+ */
+static int counters_fop_open(struct inode *inode, struct file *file) {
+    /* Minor is the counter number, device is unregistered if it isn't found */
+    struct counters_device *dev = counters_find_device(iminor(inode));
+    struct counters_reader *reader;
+    
+    if(!dev) {
+        return -ENODEV;
+    }
+    
+    reader = kzalloc(sizeof(struct counters_reader), GFP_KERNEL);
+    
+    if(!reader) {
+        counters_put_device(dev);
+        
+        return -ENOMEM;
+    }
+    
+    mutex_init(&reader->read_lock);
+    mutex_init(&reader->subscribe_lock);
+    mutex_init(&reader->delta_lock);
+    INIT_LIST_HEAD(&reader->list);
+    /* Reference is taken by counters_find_device() */
+    reader->dev = dev;
+    /* Delta is counted from the open() */
+    reader->cursor = counters_pulse_total(dev);
+    
+    file->private_data = reader;
+    
+    return nonseekable_open(inode, file);
+}
+
+/**
+ * Subscribe reader to the pulse events
+ * 
+ * @param reader
+ * @return 
+ * 
+ * NOTE:
+ * Events, accounted before subscription, are not queued for this reader.
+ */
+static int counters_reader_subscribe(struct counters_reader *reader) {
+    struct counters_device *dev = reader->dev;
+    int rc = 0;
+    
+    if(smp_load_acquire(&reader->subscribed)) {
+        return 0;
+    }
+    
+    mutex_lock(&reader->subscribe_lock);
+    
+    if(!reader->subscribed) {
+        rc = kfifo_alloc(&reader->events, event_queue_size, GFP_KERNEL);
+        
+        if(!rc) {
+            spin_lock(&dev->measurements_lock);
+            list_add_tail(&reader->list, &dev->readers);
+            spin_unlock(&dev->measurements_lock);
+            
+            /* Queue is ready for the lockless checks */
+            smp_store_release(&reader->subscribed, true);
+        }
+    }
+    
+    mutex_unlock(&reader->subscribe_lock);
+    
+    return rc;
+}
+
+/**
+ * Close pulse events stream
+ * 
+ * @param inode
+ * @param file
+ * @return 
+ */
+static int counters_fop_release(struct inode *inode, struct file *file) {
+    struct counters_reader *reader = file->private_data;
+    struct counters_device *dev = reader->dev;
+    
+    if(reader->subscribed) {
+        spin_lock(&dev->measurements_lock);
+        list_del(&reader->list);
+        spin_unlock(&dev->measurements_lock);
+        
+        kfifo_free(&reader->events);
+    }
+    
+    kfree(reader);
+    
+    counters_put_device(dev);
+    
+    return 0;
+}
+
+/**
+ * Read pulse events (array of struct counters_event)
+ * 
+ * @param file
+ * @param buf
+ * @param count - must be enough at least for one event record
+ * @param ppos
+ * @return 
+ */
+static ssize_t counters_fop_read(struct file *file, 
+                                 char __user *buf, 
+                                 size_t count, 
+                                 loff_t *ppos) {
+    struct counters_reader *reader = file->private_data;
+    struct counters_device *dev = reader->dev;
+    unsigned int copied;
+    int rc;
+    
+    if(count < sizeof(struct counters_event)) {
+        return -EINVAL;
+    }
+    
+    rc = counters_reader_subscribe(reader);
+    
+    if(rc) {
+        return rc;
+    }
+    
+    if(mutex_lock_interruptible(&reader->read_lock)) {
+        return -ERESTARTSYS;
+    }
+    
+    while(kfifo_is_empty(&reader->events)) {
+        if(READ_ONCE(dev->removed)) {
+            /* End of the events stream */
+            mutex_unlock(&reader->read_lock);
+            
+            return 0;
+        }
+        
+        if(file->f_flags & O_NONBLOCK) {
+            mutex_unlock(&reader->read_lock);
+            
+            return -EAGAIN;
+        }
+        
+        rc = wait_event_interruptible(dev->events_wait, 
+                                      !kfifo_is_empty(&reader->events) || 
+                                      READ_ONCE(dev->removed));
+        
+        if(rc) {
+            mutex_unlock(&reader->read_lock);
+            
+            return rc;
+        }
+    }
+    
+    rc = kfifo_to_user(&reader->events, buf, count, &copied);
+    
+    mutex_unlock(&reader->read_lock);
+    
+    return rc ? rc : copied;
+}
+
+/**
+ * Map shared memory ring of the pulse timestamps
  * 
- * @param result
- * @param x
- * @param y
- * @return 1 if negative result, else 0
+ * @param file
+ * @param vma
+ * @return 
+ */
+static int counters_fop_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct counters_reader *reader = file->private_data;
+    struct counters_device *dev = reader->dev;
+    struct counters_ring *ring;
+    int rc;
+    
+    spin_lock(&dev->measurements_lock);
+    
+    ring = dev->ring;
+    
+    if(ring) {
+        kref_get(&ring->ref);
+    }
+    
+    spin_unlock(&dev->measurements_lock);
+    
+    if(!ring) {
+        /* Ring is not enabled for this device */
+        return -ENODEV;
+    }
+    
+    if(vma->vm_pgoff || vma->vm_end - vma->vm_start > ring->length) {
+        rc = -EINVAL;
+    } else {
+        rc = remap_vmalloc_range(vma, ring->header, 0);
+    }
+    
+    if(rc) {
+        kref_put(&ring->ref, counters_ring_release);
+        
+        return rc;
+    }
+    
+    /* Reference to the ring is dropped when mapping is closed */
+    vma->vm_private_data = ring;
+    vma->vm_ops = &counters_ring_vm_ops;
+    
+    return 0;
+}
+
+static void counters_ring_vm_open(struct vm_area_struct *vma) {
+    struct counters_ring *ring = vma->vm_private_data;
+    
+    kref_get(&ring->ref);
+}
+
+static void counters_ring_vm_close(struct vm_area_struct *vma) {
+    struct counters_ring *ring = vma->vm_private_data;
+    
+    kref_put(&ring->ref, counters_ring_release);
+}
+
+/**
+ * Free shared memory ring, when it's not used by device and mappings
+ * 
+ * @param ref
+ */
+static void counters_ring_release(struct kref *ref) {
+    struct counters_ring *ring = container_of(ref, struct counters_ring, ref);
+    
+    vfree(ring->header);
+    kfree(ring);
+}
+
+/**
+ * Consistent snapshot of the device measurements
+ * 
+ * @param dev
+ * @param snapshot
+ * 
+ * NOTE:
+ * Lockless (timing_seq reader), can be called by the device drivers.
+ */
+void counters_snapshot(struct counters_device *dev, 
+                       struct counters_snapshot *snapshot) {
+    u64 timestamps[COUNTERS_WINDOW_SIZE];
+    struct counters_period_stats stats;
+    unsigned int seq;
+    unsigned int n;
+    
+    memset(snapshot, 0, sizeof(*snapshot));
+    
+    snapshot->id = dev->id;
+    
+    do {
+        seq = read_seqcount_begin(&dev->timing_seq);
+        
+        snapshot->count = dev->pulse_count;
+        snapshot->last_pulse = dev->last_pulse;
+        n = counters_window_copy(dev, timestamps);
+    } while(read_seqcount_retry(&dev->timing_seq, seq));
+    
+    counters_window_stats(timestamps, n, &stats);
+    
+    snapshot->last_pulse_period = stats.last;
+    snapshot->average_pulse_period = stats.average;
+}
+EXPORT_SYMBOL(counters_snapshot);
+
+/**
+ * COUNTERS_IOC_SNAPSHOT: store snapshot of the one device
+ * 
+ * @param device
+ * @param data - struct counters_snapshot_context
+ * @return 
  */
-static int timeval_subtract(struct timeval *result, 
-                            struct timeval *x, 
-                            struct timeval *y) {
-    /* Perform the carry for the later subtraction by updating y. */
-    if(x->tv_usec < y->tv_usec) {
-        int nsec = (y->tv_usec - x->tv_usec) / USEC_VALUE + 1;
-        y->tv_usec -= USEC_VALUE * nsec;
-        y->tv_sec += nsec;
+static int counters_snapshot_device(struct device *device, void *data) {
+    struct counters_snapshot_context *ctx = data;
+    struct counters_snapshot snapshot;
+    
+    if(device->type != &counters_device_type) {
+        return 0;
+    }
+    
+    ctx->total++;
+    
+    if(ctx->count < ctx->capacity) {
+        counters_snapshot(to_counters_device(device), &snapshot);
+        
+        if(copy_to_user(&ctx->records[ctx->count], &snapshot, sizeof(snapshot))) {
+            return -EFAULT;
+        }
+        
+        ctx->count++;
     }
     
-    if(x->tv_usec - y->tv_usec > USEC_VALUE) {
-        int nsec = (x->tv_usec - y->tv_usec) / USEC_VALUE;
-        y->tv_usec += USEC_VALUE * nsec;
-        y->tv_sec -= nsec;
+    return 0;
+}
+
+/**
+ * Counter device ioctl
+ * 
+ * @param file
+ * @param cmd
+ * @param arg
+ * @return 
+ * 
+ * NOTE:
+ * COUNTERS_IOC_DELTA return pulses since the previous call by this file.
+ * Shared state is only read, so readers don't interfere each other and
+ * cursor is advanced only when delta is delivered to the user.
+ */
+static long counters_fop_ioctl(struct file *file, 
+                               unsigned int cmd, 
+                               unsigned long arg) {
+    struct counters_reader *reader = file->private_data;
+    
+    switch(cmd) {
+        case COUNTERS_IOC_DELTA: {
+            u64 total;
+            u64 delta;
+            long rc = 0;
+            
+            mutex_lock(&reader->delta_lock);
+            
+            total = counters_pulse_total(reader->dev);
+            delta = total - reader->cursor;
+            
+            if(copy_to_user((u64 __user *)arg, &delta, sizeof(delta))) {
+                rc = -EFAULT;
+            } else {
+                reader->cursor = total;
+            }
+            
+            mutex_unlock(&reader->delta_lock);
+            
+            return rc;
+        }
+        default:
+            return -ENOTTY;
     }
+}
 
-    /* Compute the time remaining to wait. tv_usec is certainly positive. */
-    result->tv_sec = x->tv_sec - y->tv_sec;
-    result->tv_usec = x->tv_usec - y->tv_usec;
+/**
+ * Control device ioctl
+ * 
+ * @param file
+ * @param cmd
+ * @param arg
+ * @return 
+ */
+static long counters_control_ioctl(struct file *file, 
+                                   unsigned int cmd, 
+                                   unsigned long arg) {
+    void __user *argp = (void __user *)arg;
+    
+    switch(cmd) {
+        case COUNTERS_IOC_SNAPSHOT: {
+            struct counters_snapshot_request request;
+            struct counters_snapshot_context ctx;
+            int rc;
+            
+            if(copy_from_user(&request, argp, sizeof(request))) {
+                return -EFAULT;
+            }
+            
+            ctx.records = u64_to_user_ptr(request.records);
+            ctx.capacity = request.count;
+            ctx.count = 0;
+            ctx.total = 0;
+            
+            /* All counters by the one class devices list traversal */
+            rc = class_for_each_device(&counters_class, 
+                                       NULL, 
+                                       &ctx, 
+                                       counters_snapshot_device);
+            
+            if(rc) {
+                return rc;
+            }
+            
+            request.count = ctx.count;
+            request.total = ctx.total;
+            
+            return copy_to_user(argp, &request, sizeof(request)) ? -EFAULT : 0;
+        }
+        default:
+            return -ENOTTY;
+    }
+}
 
-    /* Return 1 if result is negative. */
-    return x->tv_sec < y->tv_sec;
+/**
+ * Poll pulse events stream
+ * 
+ * @param file
+ * @param wait
+ * @return 
+ */
+static unsigned int counters_fop_poll(struct file *file, 
+                                      struct poll_table_struct *wait) {
+    struct counters_reader *reader = file->private_data;
+    struct counters_device *dev = reader->dev;
+    unsigned int mask = 0;
+    
+    if(counters_reader_subscribe(reader)) {
+        return POLLERR;
+    }
+    
+    poll_wait(file, &dev->events_wait, wait);
+    
+    if(!kfifo_is_empty(&reader->events)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    
+    if(READ_ONCE(dev->removed)) {
+        mask |= POLLHUP;
+    }
+    
+    return mask;
 }
 
 static int __init counters_init(void)
 {
-    int rc = class_register(&counters_class);
+    int rc;
+    
+    /* Class data with pending pulses queue, adjacent counters never share cache lines */
+    counters_device_cache = kmem_cache_create("counters_device", 
+                                              COUNTERS_QUEUE_OFFSET + 
+                                                  COUNTERS_QUEUE_SIZE * sizeof(struct counters_pulse_slot), 
+                                              0, 
+                                              SLAB_HWCACHE_ALIGN, 
+                                              NULL);
+    
+    if(!counters_device_cache) {
+        pr_alert("Unable to create class data cache\n");
+        
+        return -ENOMEM;
+    }
+    
+    rc = alloc_chrdev_region(&counters_devt, 
+                             0, 
+                             COUNTERS_MAX_DEVICES, 
+                             DEVICE_CLASS);
+    
+    if(rc) {
+        pr_alert("Unable to allocate character devices region\n");
+        
+        kmem_cache_destroy(counters_device_cache);
+        
+        return rc;
+    }
+    
+    rc = class_register(&counters_class);
     
     if(rc) {
         pr_alert("Load class driver failed\n");
+        
+        unregister_chrdev_region(counters_devt, COUNTERS_MAX_DEVICES);
+        kmem_cache_destroy(counters_device_cache);
+        
+        return rc;
+    }
+    
+    rc = misc_register(&counters_control);
+    
+    if(rc) {
+        pr_alert("Unable to register control device\n");
+        
+        class_unregister(&counters_class);
+        unregister_chrdev_region(counters_devt, COUNTERS_MAX_DEVICES);
+        kmem_cache_destroy(counters_device_cache);
     } else {
         pr_info("Class driver loaded\n");
     }
@@ -585,7 +3023,15 @@ static void __exit counters_exit(void)
 {
     pr_info("Shutdown class driver\n");
 
+    misc_deregister(&counters_control);
+
     class_unregister(&counters_class);
+    
+    unregister_chrdev_region(counters_devt, COUNTERS_MAX_DEVICES);
+    
+    idr_destroy(&counters_idr);
+    
+    kmem_cache_destroy(counters_device_cache);
 }
 
 
@@ -2,33 +2,151 @@
 #define __LINUX_COUNTERS_H
 
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/timekeeping.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/cdev.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+
+#include "counters-uapi.h"
+
+struct counters_ring;
+struct counters_pulse_slot;
+struct counters_stats;
 
 /* Device class name */
 #define DEVICE_CLASS "counters"
 /* Device base name */
 #define DEVICE_NAME  "counter"
+/* Control device name */
+#define CONTROL_NAME "control"
+/* Max. devices, which have character device node */
+#define COUNTERS_MAX_DEVICES 16384
+/* Raw timestamps window for the period statistics (power of 2) */
+#define COUNTERS_WINDOW_SIZE 32
+/* Handler statistics: driver's hard IRQ handler duration */
+#define COUNTERS_STATS_ISR      0
+/* Handler statistics: hardware edge to the handler latency (if driver know it) */
+#define COUNTERS_STATS_LATENCY  1
+/* Handler statistics: handler to the accounting (deferred part) latency */
+#define COUNTERS_STATS_DEFER    2
+#define COUNTERS_STATS_KINDS    3
+
+/* Pulse rate windows: 1s, 10s, 60s and 15m */
+#define COUNTERS_RATE_WINDOWS 4
+/* Time buckets at the each pulse rate window */
+#define COUNTERS_RATE_BUCKETS 10
+
+/*
+ * Pulse rate window: ring of the time buckets with running sum
+ */
+struct counters_rate {
+    /* Current bucket start timestamp (ns) */
+    u64 start;
+    /* Pulses in all buckets */
+    u64 sum;
+    /* Current bucket */
+    unsigned int index;
+    /* Pulses in the each bucket */
+    u32 buckets[COUNTERS_RATE_BUCKETS];
+};
 
 /*
  * Counters class device driver common resource
+ * 
+ * NOTE:
+ * Fields are grouped by the writers: read-mostly data, IRQ side of the
+ * pulse queue (with the flush work, queued by it) and timing block (deferred
+ * accounting) are placed at the separate cache lines, cold control data is at
+ * the end. Structure and pending pulses queue are the one object of the
+ * SLAB_HWCACHE_ALIGN cache, so blocks are aligned and adjacent counters don't
+ * share cache lines. Name and driver's private data are the one allocation.
  */
 struct counters_device {
     /* Physical resource name */
     const char* name;
-    /* Measuremens lock */
-    spinlock_t measurements_lock;
-    /* Measuremens: detected pulse count */
-    unsigned long pulse_count;
-    /* Measuremens: last detected pulse timestamp */
-    struct timeval last_pulse;
-    /* Measuremens: last detected pulse period (us) */
-    struct timeval last_pulse_period;
-    /* Measuremens: average pulse period (us) */
-    struct timeval average_pulse_period;
+    /* Counter number (N at the counterN) */
+    unsigned int id;
+    /* Clock used for pulse timestamps */
+    clockid_t clock_id;
+    /* Both edges: pulse start edge, only it is counted (COUNTERS_EDGE_UNKNOWN - any edge) */
+    unsigned int pulse_edge;
+    /* CPU for the pulses processing or -1 for any CPU */
+    int cpu;
+    /* Pending pulses: lock-free queue, filled by counters_queue_pulse() (after the structure) */
+    struct counters_pulse_slot *queue;
+    /* Handler statistics, collected when counters_stats_key is enabled (per CPU) */
+    struct counters_stats __percpu *stats;
+    
+    /* Pending pulses: producers position */
+    atomic_t queue_head ____cacheline_aligned_in_smp;
+    /* Pending pulses: dropped by full queue, counted without timestamps */
+    atomic_t queue_lost;
+    /* Rejected by the driver's filter (i.e. debounce) edges */
+    atomic64_t rejected;
+    /* Deferred pulses processing for the counters_pulse_event(), queued by producers */
+    struct work_struct flush_work;
+    
+    /* Measuremens lock: serialize writers of the timing block */
+    spinlock_t measurements_lock ____cacheline_aligned_in_smp;
+    /* Timing block sequence: readers take consistent snapshot without lock */
+    seqcount_t timing_seq;
+    /* Pending pulses: consumer position (under measurements_lock) */
+    unsigned int queue_tail;
+    /* Measuremens: detected pulse count (timing block, 64-bit on all platforms) */
+    u64 pulse_count;
+    /* Measuremens: detected pulses total (timing block, never reset, base for readers' cursors) */
+    u64 pulse_total;
+    /* Measuremens: last detected pulse timestamp (ns) */
+    u64 last_pulse;
+    /* Measuremens: timestamps appended to the window (free running) */
+    unsigned int window_head;
+    /* Measuremens: first timestamp, used for the statistics (free running) */
+    unsigned int window_tail;
+    /* Measuremens: raw timestamps of the last pulses (ns), periods are computed by readers */
+    u64 window[COUNTERS_WINDOW_SIZE];
+    /* Both edges: last and previous timestamps of the rising and falling edges (ns) */
+    u64 edge_timestamps[2][2];
+    /* Measuremens: pulse rate windows (under measurements_lock) */
+    struct counters_rate rates[COUNTERS_RATE_WINDOWS];
+    /* Measuremens: log2 histogram of the pulse periods (timing block), bucket i
+     * count periods in [2^i, 2^(i+1)) ns */
+    u64 histogram[COUNTERS_HISTOGRAM_BUCKETS];
+    /* Throughput: counters_flush_pulses() calls, which account pulses (under measurements_lock) */
+    u64 flush_batches;
+    /* Throughput: pulses, accounted with timestamps (under measurements_lock) */
+    u64 flush_pulses;
+    /* Throughput: pulses, accounted without timestamps (under measurements_lock) */
+    u64 flush_lost;
+    /* Events: sequence number of the next event (under measurements_lock) */
+    u64 event_seq;
+    /* Events: opened readers list (under measurements_lock) */
+    struct list_head readers;
+    /* Shared memory ring of timestamps or NULL (under measurements_lock) */
+    struct counters_ring *ring;
+    
+    /* Events: readers wait queue */
+    wait_queue_head_t events_wait ____cacheline_aligned_in_smp;
+    /* Device is unregistered, no more events */
+    bool removed;
     /* Release device driver's resources function */
     void (*shutdown)(struct counters_device *);
+    /* Move device driver's pulse sources (i.e. IRQ) to the CPU (-1 - any) or NULL */
+    int (*set_cpu)(struct counters_device *, int);
+    /* Serialize set_cpu routine and cpu update */
+    struct mutex cpu_lock;
     /* Kernel device resource */
     struct device dev;
+    /* Character device /dev/counters/counterN */
+    struct cdev cdev;
 };
 /* Retrieve struct counters_device from struct device pointer */
 #define to_counters_device(d) container_of(d, struct counters_device, dev)
@@ -53,20 +171,158 @@ static inline void counters_put_device(struct counters_device *dev) {
         put_device(&dev->dev);
 }
 
+/* Handler statistics collection is enabled (class attribute "collect_stats") */
+DECLARE_STATIC_KEY_FALSE(counters_stats_key);
+
+void counters_stats_record(struct counters_device *dev, 
+                           unsigned int kind, 
+                           u64 value);
+
+/**
+ * Handler statistics: start of the measured interval
+ * 
+ * @return timestamp (ns) or 0 if statistics is disabled
+ */
+static inline u64 counters_stats_start(void) {
+    return static_branch_unlikely(&counters_stats_key) ? ktime_get_ns() : 0;
+}
+
+/**
+ * Handler statistics: end of the hard IRQ handler
+ * 
+ * @param dev
+ * @param start - counters_stats_start() at the handler entry
+ */
+static inline void counters_stats_isr(struct counters_device *dev, u64 start) {
+    if(static_branch_unlikely(&counters_stats_key) && start && dev) {
+        counters_stats_record(dev, COUNTERS_STATS_ISR, ktime_get_ns() - start);
+    }
+}
+
+/**
+ * Handler statistics: hardware edge to the handler latency
+ * 
+ * @param dev
+ * @param latency - latency (ns), for controllers, which timestamp edges
+ */
+static inline void counters_stats_latency(struct counters_device *dev, u64 latency) {
+    if(static_branch_unlikely(&counters_stats_key)) {
+        counters_stats_record(dev, COUNTERS_STATS_LATENCY, latency);
+    }
+}
+
+/**
+ * Current timestamp (ns) by the clock, selected for this device
+ * 
+ * @param dev
+ * @return 
+ * 
+ * NOTE:
+ * Cheap enough to be called at the very beginning of the IRQ handler.
+ */
+static inline u64 counters_timestamp(const struct counters_device *dev) {
+    switch(dev->clock_id) {
+        case CLOCK_MONOTONIC_RAW:
+            return ktime_get_raw_ns();
+        case CLOCK_BOOTTIME:
+            return ktime_get_boot_ns();
+        case CLOCK_TAI:
+            return ktime_get_tai_ns();
+        default:
+            return ktime_get_ns();
+    }
+}
+
 /*
  * GPIO pulse counter device driver resource
  */
 struct gpio_pulse_counter {
+    /* Class device */
+    struct counters_device *cdev;
     /* GPIO pin IRQ number */
     int irq;
     /* GPIO pin number */
     int gpio;
+    /* Software debounce time (ns) or 0 if disabled */
+    u64 debounce_ns;
+    /* Software debounce: re-sample line when it must be stable */
+    struct hrtimer debounce_timer;
+    /* Software debounce: timestamp of the edge, which start debounce */
+    u64 debounce_timestamp;
+    /* Line level after counted edge or -1 for both edges trigger */
+    int active_level;
+    /* Last stable (or sampled) line level */
+    int level;
+    /* Both edges: edge is reported by the line level, sampled after IRQ */
+    bool both_edges;
+    /* Adaptive mode: IRQ rate (Hz) to switch to polling or 0 if disabled */
+    unsigned int poll_threshold;
+    /* Adaptive mode: line sampling interval (ns, up to 1 s) */
+    unsigned long poll_interval_ns;
+    /* Adaptive mode: line is polled now, IRQ is disabled */
+    bool polling;
+    /* Adaptive mode: switches between IRQ and polling modes */
+    unsigned int mode_switches;
+    /* Adaptive mode: rate measurement window start timestamp */
+    u64 window_start;
+    /* Adaptive mode: pulses at the rate measurement window */
+    unsigned int window_pulses;
+    /* Adaptive mode: pulses queued by the polling, but IRQ thread not woken */
+    unsigned int poll_pending;
+    /* Adaptive mode and software debounce: timestamp of the IRQ enable */
+    u64 resume_timestamp;
+    /* Adaptive mode: line sampling timer */
+    struct hrtimer poll_timer;
+    /* Quadrature: B channel GPIO pin number */
+    int gpio_b;
+    /* Quadrature: B channel IRQ number or 0 */
+    int irq_b;
+    /* Quadrature: serialize decoder between A and B channels IRQs */
+    raw_spinlock_t quadrature_lock;
+    /* Quadrature: last lines state (A << 1 | B) */
+    unsigned int quadrature_state;
+    /* Quadrature: signed position (transitions) */
+    s64 position;
+    /* Quadrature: transitions by kind (QUADRATURE_*) */
+    u64 transitions[4];
 };
 
 struct counters_device *counters_allocate_device(const char* name, size_t driver_private_data_size);
 void counters_free_device(struct counters_device *dev);
 int counters_register_device(struct counters_device *dev);
 void counters_unregister_device(struct counters_device *dev);
-void counters_pulse(struct counters_device *dev);
+int counters_register_devices(struct counters_device **devs, unsigned int count);
+void counters_unregister_devices(struct counters_device **devs, unsigned int count);
+struct counters_device *counters_find_device(unsigned int id);
+int counters_clock_id(const char *name);
+int counters_set_clock(struct counters_device *dev, clockid_t clock_id);
+int counters_set_ring_size(struct counters_device *dev, unsigned int size);
+int counters_set_pulse_edge(struct counters_device *dev, unsigned int edge);
+int counters_set_cpu(struct counters_device *dev, int cpu);
+void counters_snapshot(struct counters_device *dev, struct counters_snapshot *snapshot);
+bool counters_queue_pulse(struct counters_device *dev, u64 timestamp, unsigned int edge);
+void counters_flush_pulses(struct counters_device *dev);
+void counters_schedule_flush(struct counters_device *dev);
+void counters_reject_pulse(struct counters_device *dev);
+void counters_pulse_event(struct counters_device *dev, u64 timestamp, unsigned int edge);
+
+/**
+ * Count pulse event with unknown edge
+ * 
+ * @param dev
+ * @param timestamp - pulse timestamp (ns), taken by counters_timestamp()
+ */
+static inline void counters_pulse_at(struct counters_device *dev, u64 timestamp) {
+    counters_pulse_event(dev, timestamp, COUNTERS_EDGE_UNKNOWN);
+}
+
+/**
+ * Count pulse event, timestamped now
+ * 
+ * @param dev
+ */
+static inline void counters_pulse(struct counters_device *dev) {
+    counters_pulse_at(dev, counters_timestamp(dev));
+}
 
 #endif
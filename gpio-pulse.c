@@ -9,10 +9,16 @@
 #include <linux/slab.h>
 #include <linux/list.h>
 #include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/driver.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
 #include <linux/printk.h>
 
 #include "counters.h"
+#include "counters-trace.h"
 
 #define DRIVER_AUTHOR "Igor V. Nikolaev <support@vedga.com>"
 #define DRIVER_DESC   "GPIO pulse counter"
@@ -23,17 +29,199 @@
 #endif
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
-struct gpio_pulse_counter_device {
-    struct counters_device* cdev;
+/* Adaptive mode: rate measurement window (ns) */
+#define ADAPTIVE_WINDOW_NS      (100 * NSEC_PER_MSEC)
+/* Adaptive mode: default line sampling interval (us) */
+#define ADAPTIVE_POLL_INTERVAL  100
+/* Adaptive mode: wake IRQ thread after this count of polled pulses */
+#define ADAPTIVE_POLL_BATCH     32
+
+/* Polling backend: default line sampling rate (Hz) */
+#define POLL_SAMPLE_RATE        1000
+
+/* Quadrature: transition kinds */
+#define QUADRATURE_NONE         0
+#define QUADRATURE_FORWARD      1
+#define QUADRATURE_REVERSE      2
+#define QUADRATURE_ILLEGAL      3
+/* Quadrature: forward transition 10 -> 00, which complete the cycle */
+#define QUADRATURE_CYCLE        ((2 << 2) | 0)
+
+/*
+ * Polling backend: lines of the one GPIO chip, sampled by the one timer
+ */
+struct gpio_pulse_poll_group {
+    /* Entry at the platform device's groups list */
     struct list_head list;
+    /* GPIO chip of all lines */
+    struct gpio_chip *chip;
+    /* Lines sampling rate (Hz) */
+    unsigned int rate;
+    /* GPIO chip access can sleep, lines are sampled by the work */
+    bool cansleep;
+    /* Sampling timer */
+    struct hrtimer timer;
+    /* Sampling work for the chips, which access can sleep */
+    struct work_struct work;
+    /* Lines count */
+    unsigned int count;
+    /* Lines descriptors */
+    struct gpio_desc **descs;
+    /* Sampled lines values */
+    int *values;
+    /* Counters for each line */
+    struct gpio_pulse_counter **counters;
+};
+
+/*
+ * Platform device driver's data
+ */
+struct gpio_pulse_platform {
+    /* Registered counters */
+    struct counters_device **devices;
+    /* Registered counters count */
+    unsigned int count;
+    /* Allocated devices array entries */
+    unsigned int capacity;
+    /* Polling backend groups (struct gpio_pulse_poll_group) */
+    struct list_head poll_groups;
+};
+
+/*
+ * Counter configuration from the device tree node
+ */
+struct gpio_pulse_config {
+    /* Clock for pulse timestamps */
+    clockid_t clock_id;
+    /* Debounce time (us) or 0 */
+    u32 debounce_us;
+    /* Adaptive mode: IRQ rate (Hz) to switch to polling or 0 */
+    u32 poll_threshold;
+    /* Adaptive mode: line sampling interval (us) */
+    u32 poll_interval_us;
+    /* Polling backend: line sampling rate (Hz) */
+    u32 sample_rate;
+    /* Line is active low (pulse start by the falling edge) */
+    bool active_low;
+    /* CPU for the IRQ and pulses processing or -1 for any CPU */
+    int cpu;
 };
 
 static int device_driver_probe(struct platform_device *pdev);
 static int device_driver_remove(struct platform_device *pdev);
+static ssize_t mode_show(struct device *device, 
+                         struct device_attribute *attr, 
+                         char *buf);
+static ssize_t switches_show(struct device *device, 
+                             struct device_attribute *attr, 
+                             char *buf);
+static ssize_t threshold_show(struct device *device, 
+                              struct device_attribute *attr, 
+                              char *buf);
+static ssize_t threshold_store(struct device *device, 
+                               struct device_attribute *attr, 
+                               const char *buf, 
+                               size_t size);
+static ssize_t interval_us_show(struct device *device, 
+                                struct device_attribute *attr, 
+                                char *buf);
+static ssize_t interval_us_store(struct device *device, 
+                                 struct device_attribute *attr, 
+                                 const char *buf, 
+                                 size_t size);
+static ssize_t position_show(struct device *device, 
+                             struct device_attribute *attr, 
+                             char *buf);
+static ssize_t position_store(struct device *device, 
+                              struct device_attribute *attr, 
+                              const char *buf, 
+                              size_t size);
+static ssize_t forward_show(struct device *device, 
+                            struct device_attribute *attr, 
+                            char *buf);
+static ssize_t reverse_show(struct device *device, 
+                            struct device_attribute *attr, 
+                            char *buf);
+static ssize_t illegal_show(struct device *device, 
+                            struct device_attribute *attr, 
+                            char *buf);
 
 /* Protect access to the platform driver data */
 static DEFINE_MUTEX(this_driver_lock);
 
+/*
+ * Quadrature: position steps by the transition (old state << 2 | new state),
+ * state is A << 1 | B, forward sequence is 00 -> 01 -> 11 -> 10 -> 00
+ */
+static const s8 quadrature_steps[16] = {
+     0, +1, -1,  0,
+    -1,  0,  0, +1,
+    +1,  0,  0, -1,
+     0, -1, +1,  0,
+};
+
+/* Quadrature: kind of the transition (QUADRATURE_*) */
+static const u8 quadrature_kinds[16] = {
+    QUADRATURE_NONE,    QUADRATURE_FORWARD, QUADRATURE_REVERSE, QUADRATURE_ILLEGAL,
+    QUADRATURE_REVERSE, QUADRATURE_NONE,    QUADRATURE_ILLEGAL, QUADRATURE_FORWARD,
+    QUADRATURE_FORWARD, QUADRATURE_ILLEGAL, QUADRATURE_NONE,    QUADRATURE_REVERSE,
+    QUADRATURE_ILLEGAL, QUADRATURE_REVERSE, QUADRATURE_FORWARD, QUADRATURE_NONE,
+};
+
+/* Device attributes in the group "adaptive" */
+static DEVICE_ATTR_RO(mode);
+static DEVICE_ATTR_RO(switches);
+static DEVICE_ATTR_RW(threshold);
+static DEVICE_ATTR_RW(interval_us);
+
+/* Adaptive IRQ/polling mode attributes */
+static struct attribute *gpio_pulse_adaptive_attributes[] = {
+    &dev_attr_mode.attr,
+    &dev_attr_switches.attr,
+    &dev_attr_threshold.attr,
+    &dev_attr_interval_us.attr,
+    NULL
+};
+
+/* Adaptive IRQ/polling mode attribute group */
+static const struct attribute_group gpio_pulse_adaptive = {
+    .name = "adaptive",
+    .attrs = gpio_pulse_adaptive_attributes,
+};
+
+/* Driver's attribute groups for each counter */
+static const struct attribute_group *gpio_pulse_attr_groups[] = {
+    &gpio_pulse_adaptive,
+    NULL
+};
+
+/* Device attributes in the group "quadrature" */
+static DEVICE_ATTR_RW(position);
+static DEVICE_ATTR_RO(forward);
+static DEVICE_ATTR_RO(reverse);
+static DEVICE_ATTR_RO(illegal);
+
+/* Quadrature decoder attributes */
+static struct attribute *gpio_pulse_quadrature_attributes[] = {
+    &dev_attr_position.attr,
+    &dev_attr_forward.attr,
+    &dev_attr_reverse.attr,
+    &dev_attr_illegal.attr,
+    NULL
+};
+
+/* Quadrature decoder attribute group */
+static const struct attribute_group gpio_pulse_quadrature = {
+    .name = "quadrature",
+    .attrs = gpio_pulse_quadrature_attributes,
+};
+
+/* Driver's attribute groups for each quadrature counter */
+static const struct attribute_group *gpio_pulse_quadrature_attr_groups[] = {
+    &gpio_pulse_quadrature,
+    NULL
+};
+
 static const struct of_device_id pulse_counter_of_match[] = {
         { .compatible = "gpio-pulse-counter", },
         { },
@@ -49,20 +237,692 @@ static struct platform_driver gpio_pulse_counter_device_driver = {
         }
 };
 
-static irqreturn_t device_isr(int irq, 
-                              void *dev_id) {
+/**
+ * Adaptive mode: max. pulses at the rate measurement window for IRQ mode
+ * 
+ * @param drvdata
+ * @return 
+ */
+static inline unsigned int adaptive_budget(const struct gpio_pulse_counter *drvdata) {
+    unsigned int windows_per_second = NSEC_PER_SEC / ADAPTIVE_WINDOW_NS;
+    
+    return max(1u, READ_ONCE(drvdata->poll_threshold) / windows_per_second);
+}
+
+/**
+ * Both edges: edge by the line level after it
+ * 
+ * @param level
+ * @return 
+ */
+static inline unsigned int line_edge(int level) {
+    return level ? COUNTERS_EDGE_RISING : COUNTERS_EDGE_FALLING;
+}
+
+/**
+ * Sampled transition is counted edge
+ * 
+ * @param drvdata
+ * @param level - line level after transition
+ * @return 
+ * 
+ * NOTE:
+ * Sampled lines count the same edges, as IRQ with the line's trigger: any
+ * edge only for IRQ_TYPE_EDGE_BOTH, otherwise edge to the active level.
+ */
+static inline bool line_counted(const struct gpio_pulse_counter *drvdata, int level) {
+    return drvdata->active_level < 0 || level == drvdata->active_level;
+}
+
+/**
+ * Hard IRQ handler: only timestamp and queue pulse
+ * 
+ * @param irq
+ * @param dev_id
+ * @return 
+ */
+static irqreturn_t device_isr_pulse(int irq, 
+                                    void *dev_id) {
     if(dev_id) {
-        /* Handle detected pulse */
-        counters_pulse((struct counters_device*)dev_id);
+        struct counters_device *cdev = dev_id;
+        /* Timestamp pulse as early as possible */
+        u64 timestamp = counters_timestamp(cdev);
+        struct gpio_pulse_counter *drvdata = dev_get_drvdata(&cdev->dev);
+        unsigned int edge = COUNTERS_EDGE_UNKNOWN;
+        
+        if(drvdata->debounce_ns) {
+            if(drvdata->active_level >= 0 && 
+               timestamp - drvdata->resume_timestamp < drvdata->debounce_ns && 
+               (gpio_get_value(drvdata->gpio) ? 1 : 0) == drvdata->active_level) {
+                /* Single edge: edge, latched while IRQ was masked and replayed
+                 * by enable_irq(), line is still active after counted edge */
+                return IRQ_HANDLED;
+            }
+            
+            /* Software debounce: mask line until it's must be stable */
+            disable_irq_nosync(irq);
+            
+            drvdata->debounce_timestamp = timestamp;
+            
+            /* Pinned: timer follow the IRQ's CPU (cpu attribute) */
+            hrtimer_start(&drvdata->debounce_timer, 
+                          ns_to_ktime(drvdata->debounce_ns), 
+                          HRTIMER_MODE_REL_PINNED);
+            
+            return IRQ_HANDLED;
+        }
+        
+        if(drvdata->poll_threshold) {
+            int level = gpio_get_value(drvdata->gpio) ? 1 : 0;
+            
+            if(timestamp - drvdata->resume_timestamp < drvdata->poll_interval_ns && 
+               level == drvdata->level) {
+                /* Edge, latched while IRQ was disabled, it's already polled */
+                return IRQ_HANDLED;
+            }
+            
+            drvdata->level = level;
+            
+            if(drvdata->both_edges) {
+                edge = line_edge(level);
+            }
+            
+            if(timestamp - drvdata->window_start >= ADAPTIVE_WINDOW_NS) {
+                /* New rate measurement window */
+                drvdata->window_start = timestamp;
+                drvdata->window_pulses = 0;
+            }
+            
+            if(++drvdata->window_pulses > adaptive_budget(drvdata)) {
+                /* IRQ storm: switch to the line polling */
+                disable_irq_nosync(irq);
+                
+                WRITE_ONCE(drvdata->polling, true);
+                WRITE_ONCE(drvdata->mode_switches, drvdata->mode_switches + 1);
+                
+                drvdata->window_start = timestamp;
+                drvdata->window_pulses = 0;
+                drvdata->poll_pending = 0;
+                
+                /* Pinned: polling stay at the IRQ's CPU (cpu attribute) */
+                hrtimer_start(&drvdata->poll_timer, 
+                              ns_to_ktime(drvdata->poll_interval_ns), 
+                              HRTIMER_MODE_REL_PINNED);
+            }
+        } else if(drvdata->both_edges) {
+            /* Line level after edge, sampled as close to it as possible */
+            edge = line_edge(gpio_get_value(drvdata->gpio));
+        }
+        
+        /* Queue detected pulse, it's accounted by the IRQ thread */
+        counters_queue_pulse(cdev, timestamp, edge);
         
         /* IRQ handled by this device */
-        return IRQ_HANDLED;
+        return IRQ_WAKE_THREAD;
     }
     
     /* IRQ not handled by this device */
     return IRQ_NONE;
 }
 
+/**
+ * Hard IRQ handler with entry and exit tracepoints and duration statistics
+ * 
+ * @param irq
+ * @param dev_id
+ * @return 
+ * 
+ * NOTE:
+ * Disabled tracepoints are skipped by the static keys.
+ */
+static irqreturn_t device_isr(int irq, 
+                              void *dev_id) {
+    u64 start = counters_stats_start();
+    irqreturn_t ret;
+    
+    trace_counters_irq_entry(dev_id, irq);
+    
+    ret = device_isr_pulse(irq, dev_id);
+    
+    trace_counters_irq_exit(dev_id, irq, ret);
+    
+    /* Handler duration, GPIO controller don't provide edge timestamp */
+    counters_stats_isr(dev_id, start);
+    
+    return ret;
+}
+
+/**
+ * Quadrature: current lines state
+ * 
+ * @param drvdata
+ * @return A << 1 | B
+ */
+static inline unsigned int quadrature_state(const struct gpio_pulse_counter *drvdata) {
+    return (!!gpio_get_value(drvdata->gpio) << 1) | !!gpio_get_value(drvdata->gpio_b);
+}
+
+/**
+ * Quadrature: hard IRQ handler of the A and B channels
+ * 
+ * @param irq
+ * @param dev_id
+ * @return 
+ * 
+ * NOTE:
+ * Transition is decoded only by the table lookups. Each complete forward
+ * cycle is the class pulse.
+ */
+static irqreturn_t quadrature_isr(int irq, 
+                                  void *dev_id) {
+    struct counters_device *cdev = dev_id;
+    /* Timestamp pulse as early as possible */
+    u64 timestamp = counters_timestamp(cdev);
+    u64 start = counters_stats_start();
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(&cdev->dev);
+    unsigned int transition;
+    
+    raw_spin_lock(&drvdata->quadrature_lock);
+    
+    transition = (drvdata->quadrature_state << 2) | quadrature_state(drvdata);
+    
+    drvdata->quadrature_state = transition & 3;
+    drvdata->position += quadrature_steps[transition];
+    drvdata->transitions[quadrature_kinds[transition]]++;
+    
+    raw_spin_unlock(&drvdata->quadrature_lock);
+    
+    if(transition == QUADRATURE_CYCLE) {
+        /* Queue detected pulse, it's accounted by the IRQ thread */
+        counters_queue_pulse(cdev, timestamp, COUNTERS_EDGE_UNKNOWN);
+        
+        counters_stats_isr(cdev, start);
+        
+        return IRQ_WAKE_THREAD;
+    }
+    
+    counters_stats_isr(cdev, start);
+    
+    return IRQ_HANDLED;
+}
+
+/**
+ * IRQ thread: account all queued pulses by the one batch
+ * 
+ * @param irq
+ * @param dev_id
+ * @return 
+ */
+static irqreturn_t device_isr_thread(int irq, 
+                                     void *dev_id) {
+    counters_flush_pulses((struct counters_device *)dev_id);
+    
+    return IRQ_HANDLED;
+}
+
+/**
+ * Adaptive mode: sample line, count transitions and return to IRQ mode
+ * when pulse rate is low
+ * 
+ * @param timer
+ * @return 
+ */
+static enum hrtimer_restart poll_timer_handler(struct hrtimer *timer) {
+    struct gpio_pulse_counter *drvdata = 
+        container_of(timer, struct gpio_pulse_counter, poll_timer);
+    u64 timestamp = counters_timestamp(drvdata->cdev);
+    int level = gpio_get_value(drvdata->gpio) ? 1 : 0;
+    
+    if(level != drvdata->level) {
+        drvdata->level = level;
+        
+        if(line_counted(drvdata, level)) {
+            /* Counted transition, the same as by IRQ mode */
+            counters_queue_pulse(drvdata->cdev, 
+                                 timestamp, 
+                                 drvdata->both_edges ? line_edge(level) : COUNTERS_EDGE_UNKNOWN);
+            
+            drvdata->window_pulses++;
+            
+            if(++drvdata->poll_pending >= ADAPTIVE_POLL_BATCH) {
+                /* Account batch of pulses */
+                drvdata->poll_pending = 0;
+                
+                irq_wake_thread(drvdata->irq, drvdata->cdev);
+            }
+        }
+    }
+    
+    if(timestamp - drvdata->window_start >= ADAPTIVE_WINDOW_NS) {
+        if(drvdata->poll_pending) {
+            /* Account rest of the pulses */
+            drvdata->poll_pending = 0;
+            
+            irq_wake_thread(drvdata->irq, drvdata->cdev);
+        }
+        
+        if(drvdata->window_pulses <= adaptive_budget(drvdata) / 2) {
+            /* Pulse rate is low (with hysteresis): return to the IRQ mode */
+            drvdata->resume_timestamp = timestamp;
+            drvdata->window_start = timestamp;
+            drvdata->window_pulses = 0;
+            
+            WRITE_ONCE(drvdata->polling, false);
+            WRITE_ONCE(drvdata->mode_switches, drvdata->mode_switches + 1);
+            
+            enable_irq(drvdata->irq);
+            
+            return HRTIMER_NORESTART;
+        }
+        
+        drvdata->window_start = timestamp;
+        drvdata->window_pulses = 0;
+    }
+    
+    hrtimer_forward_now(timer, ns_to_ktime(drvdata->poll_interval_ns));
+    
+    return HRTIMER_RESTART;
+}
+
+/**
+ * Setup adaptive IRQ/polling mode
+ * 
+ * @param drvdata
+ * @param config
+ */
+static void setup_adaptive(struct gpio_pulse_counter *drvdata, 
+                           const struct gpio_pulse_config *config) {
+    drvdata->poll_interval_ns = config->poll_interval_us * NSEC_PER_USEC;
+    
+    if(!config->poll_threshold) {
+        return;
+    }
+    
+    if(!gpio_is_valid(drvdata->gpio) || gpio_cansleep(drvdata->gpio)) {
+        pr_alert("%s: GPIO can't be sampled from timer, adaptive mode ignored\n", 
+                 drvdata->cdev->name);
+        
+        return;
+    }
+    
+    if(drvdata->debounce_ns) {
+        pr_alert("%s: adaptive mode is not compatible with software debounce, ignored\n", 
+                 drvdata->cdev->name);
+        
+        return;
+    }
+    
+    drvdata->poll_threshold = config->poll_threshold;
+}
+
+/**
+ * Line level after counted edge
+ * 
+ * @param irq
+ * @param active_low - line is active low (used if trigger is not an edge)
+ * @return 0 for falling edge, 1 for rising edge, -1 for both edges
+ * 
+ * NOTE:
+ * Lines without edge trigger (i.e. gpio_to_irq() lines without DT trigger)
+ * are counted by the active edge, the same way as polled lines.
+ */
+static int line_active_level(int irq, bool active_low) {
+    switch(irq_get_trigger_type(irq)) {
+        case IRQ_TYPE_EDGE_FALLING:
+            return 0;
+        case IRQ_TYPE_EDGE_RISING:
+            return 1;
+        case IRQ_TYPE_EDGE_BOTH:
+            return -1;
+        default:
+            return active_low ? 0 : 1;
+    }
+}
+
+/**
+ * Software debounce: line must be stable now, check it's level
+ * 
+ * @param timer
+ * @return 
+ */
+static enum hrtimer_restart debounce_timer_handler(struct hrtimer *timer) {
+    struct gpio_pulse_counter *drvdata = 
+        container_of(timer, struct gpio_pulse_counter, debounce_timer);
+    int level = gpio_get_value(drvdata->gpio) ? 1 : 0;
+    bool accepted;
+    
+    if(drvdata->active_level < 0) {
+        /* Both edges: any change of the stable level */
+        accepted = level != drvdata->level;
+    } else {
+        /* Single edge: line must stay at the level after this edge. Return to
+         * the inactive level don't raise IRQ, so it can't be tracked here,
+         * replayed edges are dropped by the IRQ handler. */
+        accepted = level == drvdata->active_level;
+    }
+    
+    drvdata->level = level;
+    
+    if(accepted) {
+        /* Pulse is timestamped by the edge, not by the end of debounce */
+        counters_queue_pulse(drvdata->cdev, 
+                             drvdata->debounce_timestamp, 
+                             drvdata->both_edges ? line_edge(level) : COUNTERS_EDGE_UNKNOWN);
+        
+        irq_wake_thread(drvdata->irq, drvdata->cdev);
+    } else {
+        /* Contact bounce */
+        counters_reject_pulse(drvdata->cdev);
+    }
+    
+    /* Edges, latched while IRQ was masked, are replayed by enable_irq() */
+    drvdata->resume_timestamp = counters_timestamp(drvdata->cdev);
+    
+    enable_irq(drvdata->irq);
+    
+    return HRTIMER_NORESTART;
+}
+
+/**
+ * Setup debounce filter
+ * 
+ * @param drvdata
+ * @param debounce_us - debounce time (us) or 0
+ * 
+ * Hardware debounce is used if GPIO controller support it, otherwise
+ * IRQ is masked after each edge and line is re-sampled by hrtimer.
+ */
+static void setup_debounce(struct gpio_pulse_counter *drvdata, 
+                           unsigned int debounce_us) {
+    if(!debounce_us) {
+        return;
+    }
+    
+    if(!gpio_is_valid(drvdata->gpio)) {
+        pr_alert("%s: debounce require GPIO, ignored\n", drvdata->cdev->name);
+        
+        return;
+    }
+    
+    if(!gpiod_set_debounce(gpio_to_desc(drvdata->gpio), debounce_us)) {
+        pr_info("%s: hardware debounce %u us\n", drvdata->cdev->name, debounce_us);
+        
+        return;
+    }
+    
+    if(gpio_cansleep(drvdata->gpio)) {
+        pr_alert("%s: GPIO can't be sampled from timer, debounce ignored\n", 
+                 drvdata->cdev->name);
+        
+        return;
+    }
+    
+    drvdata->debounce_ns = (u64)debounce_us * NSEC_PER_USEC;
+    
+    pr_info("%s: software debounce %u us\n", drvdata->cdev->name, debounce_us);
+}
+
+/**
+ * Polling backend: sample all group's lines by the one bulk read
+ * 
+ * @param group
+ */
+static void poll_group_sample(struct gpio_pulse_poll_group *group) {
+    unsigned int i;
+    int rc = group->cansleep ? 
+        gpiod_get_array_value_cansleep(group->count, group->descs, group->values) :
+        gpiod_get_array_value(group->count, group->descs, group->values);
+    
+    if(rc) {
+        return;
+    }
+    
+    for(i = 0; i < group->count; i++) {
+        struct gpio_pulse_counter *drvdata = group->counters[i];
+        int level = group->values[i] ? 1 : 0;
+        
+        if(level != drvdata->level) {
+            drvdata->level = level;
+            
+            if(line_counted(drvdata, level)) {
+                /* Software detected edge */
+                counters_queue_pulse(drvdata->cdev, 
+                                     counters_timestamp(drvdata->cdev), 
+                                     COUNTERS_EDGE_UNKNOWN);
+                
+                counters_schedule_flush(drvdata->cdev);
+            }
+        }
+    }
+}
+
+static void poll_group_work(struct work_struct *work) {
+    poll_group_sample(container_of(work, struct gpio_pulse_poll_group, work));
+}
+
+static enum hrtimer_restart poll_group_timer_handler(struct hrtimer *timer) {
+    struct gpio_pulse_poll_group *group = 
+        container_of(timer, struct gpio_pulse_poll_group, timer);
+    
+    if(group->cansleep) {
+        /* Chip access can sleep (i.e. I2C expander) */
+        queue_work(system_highpri_wq, &group->work);
+    } else {
+        poll_group_sample(group);
+    }
+    
+    hrtimer_forward_now(timer, ns_to_ktime(NSEC_PER_SEC / group->rate));
+    
+    return HRTIMER_RESTART;
+}
+
+/**
+ * Polling backend: add counter to the group of it's GPIO chip and sample rate
+ * 
+ * @param groups - platform device's groups list
+ * @param drvdata
+ * @param rate - sampling rate (Hz)
+ * @return 
+ * 
+ * NOTE:
+ * Group's timer is started by poll_groups_start() after all lines are added.
+ */
+static int poll_group_add(struct list_head *groups, 
+                          struct gpio_pulse_counter *drvdata, 
+                          unsigned int rate) {
+    struct gpio_desc *desc = gpio_to_desc(drvdata->gpio);
+    struct gpio_chip *chip = gpiod_to_chip(desc);
+    struct gpio_pulse_poll_group *group;
+    bool created = false;
+    unsigned int count;
+    void *p;
+    
+    list_for_each_entry(group, groups, list) {
+        if(group->chip == chip && group->rate == rate) {
+            break;
+        }
+    }
+    
+    if(&group->list == groups) {
+        /* New group, it's listed only when all it's allocations succeed */
+        group = kzalloc(sizeof(struct gpio_pulse_poll_group), GFP_KERNEL);
+        
+        if(!group) {
+            return -ENOMEM;
+        }
+        
+        group->chip = chip;
+        group->rate = rate;
+        group->cansleep = gpiod_cansleep(desc);
+        
+        hrtimer_init(&group->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        group->timer.function = poll_group_timer_handler;
+        INIT_WORK(&group->work, poll_group_work);
+        
+        created = true;
+    }
+    
+    count = group->count + 1;
+    
+    p = krealloc(group->descs, count * sizeof(*group->descs), GFP_KERNEL);
+    
+    if(p) {
+        group->descs = p;
+        
+        p = krealloc(group->values, count * sizeof(*group->values), GFP_KERNEL);
+    }
+    
+    if(p) {
+        group->values = p;
+        
+        p = krealloc(group->counters, count * sizeof(*group->counters), GFP_KERNEL);
+    }
+    
+    if(!p) {
+        if(created) {
+            /* Empty group must not be listed and sampled */
+            kfree(group->descs);
+            kfree(group->values);
+            kfree(group);
+        }
+        
+        return -ENOMEM;
+    }
+    
+    group->counters = p;
+    
+    group->descs[group->count] = desc;
+    group->counters[group->count] = drvdata;
+    group->count = count;
+    
+    if(created) {
+        list_add_tail(&group->list, groups);
+    }
+    
+    return 0;
+}
+
+/**
+ * Polling backend: start sampling of all groups
+ * 
+ * @param groups
+ */
+static void poll_groups_start(struct list_head *groups) {
+    struct gpio_pulse_poll_group *group;
+    
+    list_for_each_entry(group, groups, list) {
+        pr_info("Polling %u line(s) of %s at %u Hz\n", 
+                group->count, group->chip->label, group->rate);
+        
+        hrtimer_start(&group->timer, 
+                      ns_to_ktime(NSEC_PER_SEC / group->rate), 
+                      HRTIMER_MODE_REL);
+    }
+}
+
+/**
+ * Polling backend: stop sampling and free all groups
+ * 
+ * @param groups
+ */
+static void poll_groups_free(struct list_head *groups) {
+    struct gpio_pulse_poll_group *group;
+    struct gpio_pulse_poll_group *n;
+    
+    list_for_each_entry_safe(group, n, groups, list) {
+        list_del(&group->list);
+        
+        hrtimer_cancel(&group->timer);
+        cancel_work_sync(&group->work);
+        
+        kfree(group->descs);
+        kfree(group->values);
+        kfree(group->counters);
+        kfree(group);
+    }
+}
+
+/**
+ * Store registered counter at the platform device's array
+ * 
+ * @param platform
+ * @param cdev
+ * @return 
+ * 
+ * NOTE:
+ * Array grows twice, so probe of the many counters is amortized O(1) per
+ * counter.
+ */
+static int platform_add_device(struct gpio_pulse_platform *platform, 
+                               struct counters_device *cdev) {
+    if(platform->count == platform->capacity) {
+        unsigned int capacity = platform->capacity ? 2 * platform->capacity : 16;
+        struct counters_device **devices = 
+            krealloc(platform->devices, capacity * sizeof(*devices), GFP_KERNEL);
+        
+        if(!devices) {
+            return -ENOMEM;
+        }
+        
+        platform->devices = devices;
+        platform->capacity = capacity;
+    }
+    
+    platform->devices[platform->count++] = cdev;
+    
+    return 0;
+}
+
+/**
+ * Move counter's IRQ to the CPU
+ * 
+ * @param cdev
+ * @param cpu - CPU or -1 for any CPU
+ * @return 
+ * 
+ * NOTE:
+ * IRQ thread follow the IRQ affinity.
+ */
+static int device_set_cpu(struct counters_device *cdev, int cpu) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(&cdev->dev);
+    /* Affinity is restored to all CPUs, then hint is removed */
+    const struct cpumask *mask = (cpu < 0) ? cpu_online_mask : cpumask_of(cpu);
+    int rc = 0;
+    
+    if(drvdata->irq) {
+        rc = irq_set_affinity_hint(drvdata->irq, mask);
+    }
+    
+    if(!rc && drvdata->irq_b) {
+        rc = irq_set_affinity_hint(drvdata->irq_b, mask);
+    }
+    
+    if(cpu < 0) {
+        if(drvdata->irq) {
+            irq_set_affinity_hint(drvdata->irq, NULL);
+        }
+        
+        if(drvdata->irq_b) {
+            irq_set_affinity_hint(drvdata->irq_b, NULL);
+        }
+    }
+    
+    return rc;
+}
+
+/**
+ * Apply CPU from the configuration, when IRQs are allocated
+ * 
+ * @param cdev
+ * @param config
+ */
+static void setup_cpu(struct counters_device *cdev, 
+                      const struct gpio_pulse_config *config) {
+    if(config->cpu >= 0 && counters_set_cpu(cdev, config->cpu)) {
+        pr_alert("%s: unable to move to CPU %d, any CPU used\n", cdev->name, config->cpu);
+    }
+}
+
 static void shutdown_device(struct counters_device *cdev) {
     struct gpio_pulse_counter *drvdata = dev_get_drvdata(&cdev->dev);
     
@@ -71,10 +931,29 @@ static void shutdown_device(struct counters_device *cdev) {
     if(drvdata->irq) {
         pr_devel("Release IRQ %d\n", drvdata->irq);
         
+        /* Affinity hint must be removed before IRQ is free */
+        irq_set_affinity_hint(drvdata->irq, NULL);
+        
+        if(drvdata->debounce_ns || drvdata->poll_threshold) {
+            /* Debounce and polling timers re-enable IRQ, stop all */
+            disable_irq(drvdata->irq);
+            hrtimer_cancel(&drvdata->debounce_timer);
+            hrtimer_cancel(&drvdata->poll_timer);
+        }
+        
         /* Free IRQ */
         free_irq(drvdata->irq, cdev);
     }
     
+    if(drvdata->irq_b) {
+        pr_devel("Release IRQ %d\n", drvdata->irq_b);
+        
+        irq_set_affinity_hint(drvdata->irq_b, NULL);
+        
+        /* Free quadrature B channel IRQ */
+        free_irq(drvdata->irq_b, cdev);
+    }
+    
     /* We don't need release GPIO resource, because it released automatically */
 #if 0    
     if(gpio_is_valid(drvdata->gpio)) {
@@ -90,15 +969,19 @@ static void shutdown_device(struct counters_device *cdev) {
  * Build device data and register new device in system
  * 
  * @param name
- * @param irq
+ * @param irq - IRQ or 0 if line must be polled
  * @param gpio
+ * @param config - counter configuration
  * @return registered device driver
  * 
  * 1. Allocate counters_device structure
  * 2. Setup driver's private data
  * 3. Register device driver by counters_device structure
  */
-struct counters_device *build_device(const char *name, int irq, int gpio) {
+struct counters_device *build_device(const char *name, 
+                                     int irq, 
+                                     int gpio, 
+                                     const struct gpio_pulse_config *config) {
     struct counters_device *cdev = 
         counters_allocate_device(name, sizeof(struct gpio_pulse_counter));
 
@@ -111,8 +994,21 @@ struct counters_device *build_device(const char *name, int irq, int gpio) {
         int status;
 
         /* IRQ and GPIO still not allocated */
+        drvdata->cdev = cdev;
         drvdata->irq = 0;
         drvdata->gpio = -EINVAL;
+        
+        /* Software debounce and adaptive mode timers */
+        hrtimer_init(&drvdata->debounce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        drvdata->debounce_timer.function = debounce_timer_handler;
+        hrtimer_init(&drvdata->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        drvdata->poll_timer.function = poll_timer_handler;
+        
+        /* Clock for pulse timestamps */
+        counters_set_clock(cdev, config->clock_id);
+        
+        /* Driver's attributes */
+        cdev->dev.groups = gpio_pulse_attr_groups;
 
         status = counters_register_device(cdev);
 
@@ -139,34 +1035,270 @@ struct counters_device *build_device(const char *name, int irq, int gpio) {
 
         /* Some hardware resources may be allocated, need special driver's shutdown routine */
         cdev->shutdown = shutdown_device;
+        cdev->set_cpu = device_set_cpu;
         
         /* GPIO is allocated and must be free late */
         drvdata->gpio = gpio;
         
-        /* Attach IRQ handler */
-        status = request_irq(irq, 
-                             device_isr, 
-                             IRQF_SHARED,
-                             name,
-                             cdev);  
+        if(!irq) {
+            /* Polling backend: pulse start when line become active */
+            drvdata->active_level = config->active_low ? 0 : 1;
+            drvdata->level = gpio_get_value_cansleep(gpio) ? 1 : 0;
+            drvdata->polling = true;
+            
+            if(config->debounce_us && 
+               gpiod_set_debounce(gpio_to_desc(gpio), config->debounce_us)) {
+                /* Sampling rate is the only software filter for polled line */
+                pr_alert("%s: hardware debounce not supported, ignored\n", name);
+            }
+            
+            /* Deferred accounting only, line is sampled by the group's timer */
+            setup_cpu(cdev, config);
+            
+            /* Line will be sampled by the group of the same GPIO chip */
+            return cdev;
+        }
+        
+        /* IRQ number must be known by the timers before first IRQ */
+        drvdata->irq = irq;
+        drvdata->active_level = line_active_level(irq, config->active_low);
+        
+        if(gpio_is_valid(gpio) && !gpio_cansleep(gpio)) {
+            drvdata->level = gpio_get_value(gpio) ? 1 : 0;
+            
+            if(irq_get_trigger_type(irq) == IRQ_TYPE_EDGE_BOTH) {
+                /* Both edges: count pulse start, measure width by it's end
+                 * (lines without edge trigger keep counting of any edge) */
+                drvdata->both_edges = true;
+                
+                counters_set_pulse_edge(cdev, 
+                                        config->active_low ? 
+                                            COUNTERS_EDGE_FALLING : 
+                                            COUNTERS_EDGE_RISING);
+            }
+        }
+        
+        /* Debounce filter and adaptive mode must be ready before first IRQ */
+        setup_debounce(drvdata, config->debounce_us);
+        setup_adaptive(drvdata, config);
+        
+        /* Attach IRQ handler and thread. Software debounce and adaptive mode
+         * mask the line, so it can't be shared with other devices. */
+        status = request_threaded_irq(irq, 
+                                      device_isr, 
+                                      device_isr_thread, 
+                                      (drvdata->debounce_ns || drvdata->poll_threshold) ? 
+                                          0 : IRQF_SHARED,
+                                      name,
+                                      cdev);  
 
         if(status) {
             pr_alert("Unable to register IRQ handler\n");
             
+            /* IRQ is not allocated */
+            drvdata->irq = 0;
+            
             counters_unregister_device(cdev);
             
             return ERR_PTR(status);
         }
 
-        /* IRQ is allocated and must be free late */
-        drvdata->irq = irq;
+        setup_cpu(cdev, config);
         
+        /* IRQ is allocated and must be free late */
         return cdev;
     }
 }
 
+/**
+ * Build quadrature decoder device and register it in system
+ * 
+ * @param name
+ * @param gpio - A channel GPIO
+ * @param gpio_b - B channel GPIO
+ * @param config - counter configuration
+ * @return registered device driver
+ * 
+ * Both channels must have IRQ by both edges and must be readable from the
+ * IRQ handler.
+ */
+static struct counters_device *build_quadrature_device(const char *name, 
+                                                       int gpio, 
+                                                       int gpio_b, 
+                                                       const struct gpio_pulse_config *config) {
+    int irq = gpio_to_irq(gpio);
+    int irq_b = gpio_to_irq(gpio_b);
+    struct counters_device *cdev;
+    struct gpio_pulse_counter *drvdata;
+    int status;
+    
+    if(irq <= 0 || irq_b <= 0 || gpio_cansleep(gpio) || gpio_cansleep(gpio_b)) {
+        pr_alert("%s: quadrature require IRQ capable GPIO for both channels\n", name);
+        
+        return ERR_PTR(-EINVAL);
+    }
+    
+    cdev = counters_allocate_device(name, sizeof(struct gpio_pulse_counter));
+
+    if(IS_ERR_OR_NULL(cdev)) {
+        pr_alert("Unable to allocate class data\n");
+
+        return cdev ? cdev : ERR_PTR(-ENOMEM);
+    }
+    
+    drvdata = dev_get_drvdata(&cdev->dev);
+    
+    /* IRQ and GPIO still not allocated */
+    drvdata->cdev = cdev;
+    drvdata->irq = 0;
+    drvdata->gpio = -EINVAL;
+    drvdata->gpio_b = -EINVAL;
+    
+    raw_spin_lock_init(&drvdata->quadrature_lock);
+    
+    /* Clock for pulse timestamps */
+    counters_set_clock(cdev, config->clock_id);
+    
+    /* Driver's attributes */
+    cdev->dev.groups = gpio_pulse_quadrature_attr_groups;
+
+    status = counters_register_device(cdev);
+
+    if(status) {
+        pr_alert("Unable to register device\n");
+
+        counters_free_device(cdev);
+
+        return ERR_PTR(status);
+    }
+    
+    /* Allocate both GPIO pins to prevent usage by other drivers */
+    status = devm_gpio_request(&cdev->dev, gpio, name);
+    
+    if(!status) {
+        status = devm_gpio_request(&cdev->dev, gpio_b, name);
+    }
+    
+    if(status) {
+        pr_alert("Unable to allocate GPIO pins %d, %d\n", gpio, gpio_b);
+        
+        counters_unregister_device(cdev);
+        
+        return ERR_PTR(status);
+    }
+    
+    /* Some hardware resources may be allocated, need special driver's shutdown routine */
+    cdev->shutdown = shutdown_device;
+    cdev->set_cpu = device_set_cpu;
+    
+    drvdata->gpio = gpio;
+    drvdata->gpio_b = gpio_b;
+    drvdata->quadrature_state = quadrature_state(drvdata);
+    
+    /* Attach IRQ handlers of the both channels */
+    drvdata->irq = irq;
+    
+    status = request_threaded_irq(irq, 
+                                  quadrature_isr, 
+                                  device_isr_thread, 
+                                  IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+                                  name,
+                                  cdev);
+    
+    if(status) {
+        /* IRQ is not allocated */
+        drvdata->irq = 0;
+    } else {
+        drvdata->irq_b = irq_b;
+        
+        status = request_threaded_irq(irq_b, 
+                                      quadrature_isr, 
+                                      device_isr_thread, 
+                                      IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+                                      name,
+                                      cdev);
+        
+        if(status) {
+            /* IRQ is not allocated */
+            drvdata->irq_b = 0;
+        }
+    }
+    
+    if(status) {
+        pr_alert("Unable to register IRQ handler\n");
+        
+        /* A channel IRQ (if allocated) is free by the shutdown routine */
+        counters_unregister_device(cdev);
+        
+        return ERR_PTR(status);
+    }
+    
+    setup_cpu(cdev, config);
+    
+    return cdev;
+}
+
+/**
+ * Retrieve counter configuration from the device tree node
+ * 
+ * @param pp
+ * @param config
+ */
+static void parse_config(struct device_node *pp, 
+                         struct gpio_pulse_config *config) {
+    const char *clock_name;
+    int clock_id;
+    u32 cpu;
+    
+    config->clock_id = CLOCK_MONOTONIC;
+    config->debounce_us = 0;
+    config->poll_threshold = 0;
+    config->poll_interval_us = ADAPTIVE_POLL_INTERVAL;
+    config->sample_rate = POLL_SAMPLE_RATE;
+    config->cpu = -1;
+    
+    if(!of_property_read_string(pp, "timestamp-clock", &clock_name)) {
+        clock_id = counters_clock_id(clock_name);
+        
+        if(clock_id < 0) {
+            pr_alert("Device %s: unknown timestamp clock %s, used monotonic\n", 
+                     pp->name, clock_name);
+        } else {
+            config->clock_id = clock_id;
+        }
+    }
+    
+    /* Debounce time (us) */
+    of_property_read_u32(pp, "debounce-us", &config->debounce_us);
+    
+    /* Adaptive IRQ/polling mode */
+    of_property_read_u32(pp, "poll-threshold-hz", &config->poll_threshold);
+    of_property_read_u32(pp, "poll-interval-us", &config->poll_interval_us);
+    
+    if(!config->poll_interval_us || config->poll_interval_us > USEC_PER_SEC) {
+        config->poll_interval_us = ADAPTIVE_POLL_INTERVAL;
+    }
+    
+    /* Polling backend (for lines without IRQ) */
+    of_property_read_u32(pp, "sample-rate-hz", &config->sample_rate);
+    
+    if(!config->sample_rate || config->sample_rate > NSEC_PER_SEC) {
+        config->sample_rate = POLL_SAMPLE_RATE;
+    }
+    
+    /* CPU for the IRQ and pulses processing */
+    if(!of_property_read_u32(pp, "cpu-affinity", &cpu)) {
+        if(cpu < nr_cpu_ids) {
+            config->cpu = cpu;
+        } else {
+            pr_alert("Device %s: no CPU %u, any CPU used\n", pp->name, cpu);
+        }
+    }
+}
+
 static int device_driver_probe_dt(struct platform_device *pdev, 
                                   struct device_node *node) {
+    struct gpio_pulse_platform *platform = platform_get_drvdata(pdev);
     int devices = 0;
     
     if(node) {
@@ -175,40 +1307,61 @@ static int device_driver_probe_dt(struct platform_device *pdev,
         pr_devel("Populate device tree nodes (total=%u)\n", of_get_child_count(node));
         
         for_each_child_of_node(node, pp) {
-            int gpio = of_get_gpio(pp, 0);
+            enum of_gpio_flags flags = 0;
+            int gpio = of_get_gpio_flags(pp, 0, &flags);
+            /* Second GPIO is quadrature B channel */
+            int gpio_b = (of_gpio_count(pp) == 2) ? of_get_gpio(pp, 1) : -ENOENT;
             int irq = irq_of_parse_and_map(pp, 0);
+            struct gpio_pulse_config config;
+            
+            parse_config(pp, &config);
+            config.active_low = flags & OF_GPIO_ACTIVE_LOW;
 
             if(!irq && gpio_is_valid(gpio)) {
                 /* Try to determine IRQ by GPIO */
                 irq = gpio_to_irq(gpio);
 
                 if(irq < 0) {
-                    /* GPIO not support IRQ mode */
-                    return irq;
+                    /* GPIO not support IRQ mode, line will be polled */
+                    irq = 0;
                 }
             }
             
-            if(irq) {
+            if(irq || gpio_is_valid(gpio)) {
                 /* Build and register device */
-                struct counters_device *cdev = build_device(pp->name, irq, gpio);
+                struct counters_device *cdev = gpio_is_valid(gpio_b) ? 
+                    build_quadrature_device(pp->name, gpio, gpio_b, &config) : 
+                    build_device(pp->name, irq, gpio, &config);
                 
                 if(IS_ERR_OR_NULL(cdev)) {
                     pr_alert("Unable to allocate data for %s, skipped\n", pp->name);
                 } else {
-                    struct gpio_pulse_counter_device *entry = 
-                        kmalloc(sizeof(struct gpio_pulse_counter_device), GFP_KERNEL);
+                    bool added = !platform_add_device(platform, cdev);
+                    u32 ring_size;
                     
-                    if(entry) {
-                        struct list_head *devlist = platform_get_drvdata(pdev);
-
-                        pr_devel("Allocated deventry=%pK\n", entry);
-                        
-                        INIT_LIST_HEAD(&entry->list);
-                        entry->cdev = cdev;
-                        
-                        list_add(&entry->list, devlist);
+                    if(!of_property_read_u32(pp, "ring-size", &ring_size) && 
+                       counters_set_ring_size(cdev, ring_size)) {
+                        pr_alert("Device %s: unable to setup timestamps ring\n", pp->name);
+                    }
+                    
+                    if(added && !irq && 
+                       poll_group_add(&platform->poll_groups, 
+                                      dev_get_drvdata(&cdev->dev), 
+                                      config.sample_rate)) {
+                        /* Unable to add line to the polling group */
+                        platform->count--;
                         
-                        if(gpio_is_valid(gpio)) {
+                        added = false;
+                    }
+                    
+                    if(added) {
+                        if(gpio_is_valid(gpio_b)) {
+                            pr_info("Device #%u %s: quadrature GPIO: %d, %d\n", 
+                                    devices, pp->name, gpio, gpio_b);
+                        } else if(!irq) {
+                            pr_info("Device #%u %s: GPIO: %d polled at %u Hz\n", 
+                                    devices, pp->name, gpio, config.sample_rate);
+                        } else if(gpio_is_valid(gpio)) {
                             pr_info("Device #%u %s: IRQ: %d GPIO: %d\n", devices, pp->name, irq, gpio);
                         } else {
                             pr_info("Device #%u %s: IRQ: %d\n", devices, pp->name, irq);
@@ -222,30 +1375,37 @@ static int device_driver_probe_dt(struct platform_device *pdev,
                     }
                 }
             } else {
-                pr_alert("Device %s don't have IRQ, skipped\n", pp->name);
+                pr_alert("Device %s don't have IRQ and GPIO, skipped\n", pp->name);
             }
         }
+        
+        /* All polled lines are known, start sampling */
+        poll_groups_start(&platform->poll_groups);
     }
     
     return devices;
 }
 
 static int device_driver_probe(struct platform_device *pdev) {
-    struct list_head *devlist = kmalloc(sizeof(struct list_head), GFP_KERNEL);
+    struct gpio_pulse_platform *platform = 
+        kmalloc(sizeof(struct gpio_pulse_platform), GFP_KERNEL);
     
-    if(!devlist) {
+    if(!platform) {
         pr_alert("Unable to allocate memory for device list\n");
         
         return -ENOMEM;
     }
     
-    pr_devel("Allocated devlist=%pK\n", devlist);
+    pr_devel("Allocated platform data=%pK\n", platform);
     
-    INIT_LIST_HEAD(devlist);
+    platform->devices = NULL;
+    platform->count = 0;
+    platform->capacity = 0;
+    INIT_LIST_HEAD(&platform->poll_groups);
     
     mutex_lock(&this_driver_lock);
     
-    platform_set_drvdata(pdev, devlist);
+    platform_set_drvdata(pdev, platform);
     
     if(of_have_populated_dt()) {
         // Используется device tree
@@ -257,7 +1417,7 @@ static int device_driver_probe(struct platform_device *pdev) {
         
         mutex_unlock(&this_driver_lock);
     
-        kfree(devlist);
+        kfree(platform);
         
         return -ENODEV;
     }
@@ -268,46 +1428,208 @@ static int device_driver_probe(struct platform_device *pdev) {
 }
 
 static int device_driver_remove(struct platform_device *pdev) {
-    struct list_head *devlist;
+    struct gpio_pulse_platform *platform;
     
     mutex_lock(&this_driver_lock);
     
-    devlist = platform_get_drvdata(pdev);
+    platform = platform_get_drvdata(pdev);
     
     platform_set_drvdata(pdev, NULL);
 
     mutex_unlock(&this_driver_lock);
     
-    if(devlist) {
-        struct list_head *pos;
-        struct list_head *n;
+    if(platform) {
+        /* Stop polling before counters are unregistered */
+        poll_groups_free(&platform->poll_groups);
         
-        list_for_each_safe(pos, n, devlist) {
-            /* Got entry from the list */
-            struct gpio_pulse_counter_device *entry = 
-                list_entry(pos, struct gpio_pulse_counter_device, list);
-            
-            /* Remove entry from list */
-            list_del(pos);
-            
-            /* Unregister device */
-            counters_unregister_device(entry->cdev);
-            
-            pr_devel("Free deventry=%pK\n", entry);
-            
-            /* Free memory */
-            kfree(entry);
-        }
+        /* Unregister devices */
+        counters_unregister_devices(platform->devices, platform->count);
+        
+        kfree(platform->devices);
 
-        pr_devel("Free devlist=%pK\n", devlist);
+        pr_devel("Free platform data=%pK\n", platform);
         
         /* Free platform driver data */
-        kfree(devlist);
+        kfree(platform);
     }
     
     return 0;
 }
 
+/**
+ * Current counter mode: "irq" or "poll"
+ */
+static ssize_t mode_show(struct device *device, 
+                         struct device_attribute *attr, 
+                         char *buf) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    
+    return scnprintf(buf, PAGE_SIZE, "%s", READ_ONCE(drvdata->polling) ? "poll" : "irq");
+}
+
+/**
+ * Switches between IRQ and polling modes
+ */
+static ssize_t switches_show(struct device *device, 
+                             struct device_attribute *attr, 
+                             char *buf) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    
+    return scnprintf(buf, PAGE_SIZE, "%u", READ_ONCE(drvdata->mode_switches));
+}
+
+/**
+ * IRQ rate (Hz) to switch to polling, 0 if adaptive mode disabled
+ */
+static ssize_t threshold_show(struct device *device, 
+                              struct device_attribute *attr, 
+                              char *buf) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    
+    return scnprintf(buf, PAGE_SIZE, "%u", READ_ONCE(drvdata->poll_threshold));
+}
+
+/**
+ * Change IRQ rate (Hz) to switch to polling
+ * 
+ * NOTE:
+ * Adaptive mode can't be enabled or disabled at runtime, only tuned.
+ */
+static ssize_t threshold_store(struct device *device, 
+                               struct device_attribute *attr, 
+                               const char *buf, 
+                               size_t size) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    unsigned int value;
+    int rc = kstrtouint(buf, 0, &value);
+    
+    if(rc) {
+        return rc;
+    }
+    
+    if(!drvdata->poll_threshold || !value) {
+        return -EINVAL;
+    }
+    
+    WRITE_ONCE(drvdata->poll_threshold, value);
+    
+    return size;
+}
+
+/**
+ * Line sampling interval (us) at the polling mode
+ */
+static ssize_t interval_us_show(struct device *device, 
+                                struct device_attribute *attr, 
+                                char *buf) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    
+    return scnprintf(buf, PAGE_SIZE, "%lu", READ_ONCE(drvdata->poll_interval_ns) / NSEC_PER_USEC);
+}
+
+static ssize_t interval_us_store(struct device *device, 
+                                 struct device_attribute *attr, 
+                                 const char *buf, 
+                                 size_t size) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    unsigned int value;
+    int rc = kstrtouint(buf, 0, &value);
+    
+    if(rc) {
+        return rc;
+    }
+    
+    if(!value || value > USEC_PER_SEC) {
+        return -EINVAL;
+    }
+    
+    WRITE_ONCE(drvdata->poll_interval_ns, value * NSEC_PER_USEC);
+    
+    return size;
+}
+
+/**
+ * Quadrature: signed position (transitions)
+ * 
+ * @param device
+ * @param attr
+ * @param buf
+ * @return 
+ */
+static ssize_t position_show(struct device *device, 
+                             struct device_attribute *attr, 
+                             char *buf) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    unsigned long flags;
+    s64 value;
+    
+    raw_spin_lock_irqsave(&drvdata->quadrature_lock, flags);
+    value = drvdata->position;
+    raw_spin_unlock_irqrestore(&drvdata->quadrature_lock, flags);
+    
+    return scnprintf(buf, PAGE_SIZE, "%lld", (long long)value);
+}
+
+static ssize_t position_store(struct device *device, 
+                              struct device_attribute *attr, 
+                              const char *buf, 
+                              size_t size) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    unsigned long flags;
+    s64 value;
+    int rc = kstrtos64(buf, 0, &value);
+    
+    if(rc) {
+        return rc;
+    }
+    
+    raw_spin_lock_irqsave(&drvdata->quadrature_lock, flags);
+    drvdata->position = value;
+    raw_spin_unlock_irqrestore(&drvdata->quadrature_lock, flags);
+    
+    return size;
+}
+
+/**
+ * Quadrature: transitions count by kind
+ * 
+ * @param device
+ * @param buf
+ * @param kind - QUADRATURE_*
+ * @return 
+ */
+static ssize_t transitions_show(struct device *device, 
+                                char *buf, 
+                                unsigned int kind) {
+    struct gpio_pulse_counter *drvdata = dev_get_drvdata(device);
+    unsigned long flags;
+    u64 value;
+    
+    raw_spin_lock_irqsave(&drvdata->quadrature_lock, flags);
+    value = drvdata->transitions[kind];
+    raw_spin_unlock_irqrestore(&drvdata->quadrature_lock, flags);
+    
+    return scnprintf(buf, PAGE_SIZE, "%llu", (unsigned long long)value);
+}
+
+static ssize_t forward_show(struct device *device, 
+                            struct device_attribute *attr, 
+                            char *buf) {
+    return transitions_show(device, buf, QUADRATURE_FORWARD);
+}
+
+static ssize_t reverse_show(struct device *device, 
+                            struct device_attribute *attr, 
+                            char *buf) {
+    return transitions_show(device, buf, QUADRATURE_REVERSE);
+}
+
+static ssize_t illegal_show(struct device *device, 
+                            struct device_attribute *attr, 
+                            char *buf) {
+    return transitions_show(device, buf, QUADRATURE_ILLEGAL);
+}
+
 //struct counters_device *regDev;
 
 static int __init pulsecount_init(void)